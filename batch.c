@@ -0,0 +1,482 @@
+#include "batch.h"
+#include "vm.h"
+#include "bytecode.h"
+#include "lexer.h"
+#include "parser.h"
+#include "display.h"
+#include "jit.h"
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+/* Batch executor
+ * ==============
+ *
+ * Each program runs in its own VirtualMachine, on a fixed pool
+ * of workers. The programs are split evenly over the workers at
+ * the start, in a deque per worker. A worker takes programs from
+ * the bottom of its own deque, and once that is empty, steals
+ * from the top of the others, so that a few long programs do not
+ * keep the rest waiting behind them.
+ *
+ * The output of each machine goes to a buffer of its own, and
+ * the buffers are printed in the order of the files once all of
+ * them are done. The lexer and the parser keep their state in
+ * globals, so sources are compiled one at a time.
+ *
+ * A file which the batch names more than once is loaded once,
+ * into a snapshot, and the machine of each job which names it is
+ * spawned from that, so it is neither compiled nor copied again.
+ * A worker keeps the machine it spawned from an image, and resets
+ * it for the next job which names the same file, which only copies
+ * back the chunks the last one wrote, and keeps the records decoded
+ * from the rest. A file which is named once gets a machine of its
+ * own, which is freed once it ran.
+ *
+ * A snapshot holds a file descriptor, and a kept machine its
+ * mapping, so the batch keeps at most KEPT_IMAGES images, and each
+ * worker at most KEPT_MACHINES machines. The ones used least
+ * recently make way for new ones. An image which is dropped from
+ * the batch lives on until the last machine spawned from it is
+ * freed, so both bounds shrink to fit the images in a quarter of
+ * the files the process may open.
+ */
+
+// Snapshots the batch keeps at once
+#define KEPT_IMAGES 64
+// Machines each worker keeps at once
+#define KEPT_MACHINES 8
+
+typedef struct{
+    const char *file;
+    char *output; // what the program printed
+    size_t outputSize;
+    uint64_t retired;
+    bool loaded;
+    bool repeated; // another job names the same file
+    RunStatus status;
+} Job;
+
+typedef struct{
+    pthread_mutex_t lock;
+    uint32_t top, bottom; // jobs [top, bottom) are left
+} Deque;
+
+typedef struct Batch Batch;
+
+// A file which is loaded already
+typedef struct{
+    const char *file;
+    Snapshot *snapshot;
+    uint32_t users; // the batch, if it keeps it, and the kept machines
+    uint64_t used; // when a job last asked for it
+} Image;
+
+// A machine a worker keeps for the next job of its image
+typedef struct{
+    Image *image;
+    VirtualMachine *machine;
+    uint64_t used;
+} Kept;
+
+typedef struct{
+    pthread_t thread;
+    Batch *batch;
+    uint32_t id;
+    Deque deque;
+    uint32_t steals;
+    Kept kept[KEPT_MACHINES];
+    uint32_t keptCount;
+    uint64_t clock;
+} Worker;
+
+struct Batch{
+    Job *jobs;
+    Worker *workers;
+    uint32_t workerCount;
+    bool useJit;
+    pthread_mutex_t imageLock;
+    Image *images[KEPT_IMAGES];
+    uint32_t imageCount;
+    uint32_t maxImages, maxKept; // KEPT_IMAGES and KEPT_MACHINES, or less
+    uint64_t clock;
+};
+
+static pthread_mutex_t compileLock = PTHREAD_MUTEX_INITIALIZER;
+
+static char* read_file(const char *fileName){
+    FILE *f = fopen(fileName, "rb");
+    if(!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *buffer = length < 0 ? NULL : (char *)malloc(length + 1);
+    if(buffer){
+        length = fread(buffer, 1, length, f);
+        buffer[length] = '\0';
+    }
+    fclose(f);
+    return buffer;
+}
+
+static bool load(VirtualMachine *machine, const char *file){
+    if(bc_is_executable(file)){
+        Data binaryData = bc_read_from_disk(file, NULL);
+        machine->memory = binaryData.memory;
+        machine->memSize = binaryData.size;
+        return binaryData.size != 0;
+    }
+
+    char *source = read_file(file);
+    if(source == NULL){
+        err("Unable to read input file : "
+                ANSI_COLOR_RED ANSI_FONT_BOLD "%s" ANSI_COLOR_RESET "\n", file);
+        return false;
+    }
+    bool ret = false;
+    pthread_mutex_lock(&compileLock);
+    TokenList l = tokens_scan(source);
+    if(l.hasError == 0 && rm_init(machine, 0))
+        ret = parse_and_emit(l, &machine->memory, &machine->memSize, 0);
+    else if(l.hasError)
+        err("Scanning completed with " ANSI_FONT_BOLD ANSI_COLOR_RED "%" PRIu32 ANSI_COLOR_RESET " errors!", l.hasError);
+    tokens_free(l);
+    pthread_mutex_unlock(&compileLock);
+    free(source);
+    return ret;
+}
+
+// A new machine with the file loaded, NULL if it could not be
+static VirtualMachine* load_machine(const char *file){
+    VirtualMachine *machine = rm_new();
+    if(!load(machine, file)){
+        rm_free(machine);
+        return NULL;
+    }
+    return machine;
+}
+
+// The image of the file, NULL if it is not loaded. The caller
+// holds imageLock.
+static Image* find(Batch *batch, const char *file){
+    for(uint32_t i = 0;i < batch->imageCount;i++){
+        if(strcmp(batch->images[i]->file, file) == 0)
+            return batch->images[i];
+    }
+    return NULL;
+}
+
+// Marks the image used by the caller. The caller holds imageLock.
+static void use(Batch *batch, Image *image){
+    image->users++;
+    image->used = ++batch->clock;
+}
+
+// Drops a user of the image, and frees it after the last one
+static void release(Batch *batch, Image *image){
+    pthread_mutex_lock(&batch->imageLock);
+    bool last = --image->users == 0;
+    pthread_mutex_unlock(&batch->imageLock);
+    if(last){
+        rm_snapshot_free(image->snapshot);
+        free(image);
+    }
+}
+
+// The image of the file, used by the caller, loading it if the
+// batch does not keep it. If it could be loaded but not snapshot,
+// the loaded machine is returned in loaded instead.
+static Image* acquire(Batch *batch, const char *file, VirtualMachine **loaded){
+    *loaded = NULL;
+    pthread_mutex_lock(&batch->imageLock);
+    Image *image = find(batch, file);
+    if(image != NULL)
+        use(batch, image);
+    pthread_mutex_unlock(&batch->imageLock);
+    if(image != NULL)
+        return image;
+
+    // Loaded outside the lock, so that the workers which need other
+    // images do not wait for it. Another one may load the same file
+    // meanwhile, the image published first is kept.
+    VirtualMachine *machine = load_machine(file);
+    if(machine == NULL)
+        return NULL;
+    Snapshot *snapshot = rm_snapshot(machine);
+    if(snapshot == NULL){
+        // Run the loaded machine itself then
+        *loaded = machine;
+        return NULL;
+    }
+    rm_free(machine);
+
+    Image *evicted = NULL;
+    pthread_mutex_lock(&batch->imageLock);
+    image = find(batch, file);
+    if(image != NULL)
+        use(batch, image);
+    else if((image = (Image *)malloc(sizeof(Image))) != NULL){
+        *image = (Image){file, snapshot, 1, 0};
+        use(batch, image);
+        snapshot = NULL;
+        if(batch->imageCount < batch->maxImages)
+            batch->images[batch->imageCount++] = image;
+        else if(batch->maxImages == 0)
+            evicted = image;
+        else{
+            // Make way by the one used least recently
+            uint32_t oldest = 0;
+            for(uint32_t i = 1;i < batch->maxImages;i++){
+                if(batch->images[i]->used < batch->images[oldest]->used)
+                    oldest = i;
+            }
+            evicted = batch->images[oldest];
+            batch->images[oldest] = image;
+        }
+    }
+    pthread_mutex_unlock(&batch->imageLock);
+    // Lost the race, or could not be kept
+    if(snapshot != NULL)
+        rm_snapshot_free(snapshot);
+    if(evicted != NULL)
+        release(batch, evicted);
+    return image;
+}
+
+// A machine with the file loaded. A file which is repeated in the
+// batch is spawned from its image, or reuses the machine the worker
+// spawned from it already, reset. kept tells whether the worker
+// keeps the machine for the next job.
+static VirtualMachine* instantiate(Worker *self, Job *job, bool *kept){
+    Batch *batch = self->batch;
+    *kept = false;
+    if(!job->repeated || batch->maxKept == 0)
+        return load_machine(job->file);
+
+    for(uint32_t i = 0;i < self->keptCount;i++){
+        Kept *k = &self->kept[i];
+        if(strcmp(k->image->file, job->file) == 0){
+            k->used = ++self->clock;
+            rm_reset(k->machine);
+            *kept = true;
+            return k->machine;
+        }
+    }
+
+    VirtualMachine *machine;
+    Image *image = acquire(batch, job->file, &machine);
+    if(image == NULL)
+        return machine;
+    machine = rm_spawn(image->snapshot);
+    if(machine == NULL){
+        release(batch, image);
+        return NULL;
+    }
+
+    Kept *k = &self->kept[self->keptCount];
+    if(self->keptCount < batch->maxKept)
+        self->keptCount++;
+    else{
+        // Make way by the one used least recently
+        k = &self->kept[0];
+        for(uint32_t i = 1;i < batch->maxKept;i++){
+            if(self->kept[i].used < k->used)
+                k = &self->kept[i];
+        }
+        // before the snapshot it was spawned from
+        rm_free(k->machine);
+        release(batch, k->image);
+    }
+    *k = (Kept){image, machine, ++self->clock};
+    *kept = true;
+    return machine;
+}
+
+static void run(Worker *self, Job *job){
+    bool kept;
+    VirtualMachine *machine = instantiate(self, job, &kept);
+    job->loaded = machine != NULL;
+    if(!job->loaded)
+        return;
+    output_init_memory(&machine->output);
+    // A kept machine keeps its native code along with its records
+    if(self->batch->useJit && machine->jit == NULL && !jit_enable(machine))
+        err("Unable to start the JIT, running on the interpreter!\n");
+    job->status = rm_run(machine, 0);
+    job->retired = machine->retired;
+    // The job keeps what the program printed
+    job->output = machine->output.data;
+    job->outputSize = machine->output.size;
+    machine->output.data = NULL;
+    machine->output.size = 0;
+    if(!kept)
+        rm_free(machine);
+}
+
+// Takes the next job from the bottom of the own deque, or steals
+// one from the top of another. Returns false when all are empty.
+static bool next_job(Worker *self, uint32_t *job){
+    Deque *d = &self->deque;
+    pthread_mutex_lock(&d->lock);
+    bool found = d->top < d->bottom;
+    if(found)
+        *job = --d->bottom;
+    pthread_mutex_unlock(&d->lock);
+    if(found)
+        return true;
+
+    Batch *batch = self->batch;
+    for(uint32_t i = 1;i < batch->workerCount;i++){
+        d = &batch->workers[(self->id + i) % batch->workerCount].deque;
+        pthread_mutex_lock(&d->lock);
+        found = d->top < d->bottom;
+        if(found)
+            *job = d->top++;
+        pthread_mutex_unlock(&d->lock);
+        if(found){
+            self->steals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void* work(void *arg){
+    Worker *self = (Worker *)arg;
+    uint32_t job;
+    while(next_job(self, &job))
+        run(self, &self->batch->jobs[job]);
+    return NULL;
+}
+
+static int byFile(const void *a, const void *b){
+    return strcmp((*(Job *const *)a)->file, (*(Job *const *)b)->file);
+}
+
+// Marks the jobs whose file another job names as well
+static bool find_repeated(Job *jobs, uint32_t count){
+    Job **sorted = (Job **)malloc(sizeof(Job *) * count);
+    if(sorted == NULL)
+        return false;
+    for(uint32_t i = 0;i < count;i++)
+        sorted[i] = &jobs[i];
+    qsort(sorted, count, sizeof(Job *), byFile);
+    for(uint32_t i = 1;i < count;i++){
+        if(strcmp(sorted[i - 1]->file, sorted[i]->file) == 0)
+            sorted[i - 1]->repeated = sorted[i]->repeated = true;
+    }
+    free(sorted);
+    return true;
+}
+
+static double now(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+bool batch_run(char **files, uint32_t count, uint32_t workers, bool useJit){
+    if(workers == 0){
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cores < 1 ? 1 : (uint32_t)cores;
+    }
+    if(workers > count)
+        workers = count;
+
+    Batch batch;
+    batch.jobs = (Job *)calloc(count, sizeof(Job));
+    batch.workers = (Worker *)calloc(workers, sizeof(Worker));
+    batch.workerCount = workers;
+    batch.useJit = useJit;
+    batch.imageCount = 0;
+    // Each kept machine may hold an image of its own
+    uint64_t budget = KEPT_IMAGES + (uint64_t)KEPT_MACHINES * workers;
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur / 4 < budget)
+        budget = limit.rlim_cur / 4;
+    batch.maxKept = budget / workers < KEPT_MACHINES ? budget / workers : KEPT_MACHINES;
+    budget -= (uint64_t)batch.maxKept * workers;
+    batch.maxImages = budget < KEPT_IMAGES ? budget : KEPT_IMAGES;
+    batch.clock = 0;
+    if(batch.jobs != NULL){
+        for(uint32_t i = 0;i < count;i++)
+            batch.jobs[i].file = files[i];
+    }
+    if(batch.jobs == NULL || batch.workers == NULL || !find_repeated(batch.jobs, count)){
+        err("Unable to allocate the batch!\n");
+        free(batch.jobs);
+        free(batch.workers);
+        return false;
+    }
+    pthread_mutex_init(&batch.imageLock, NULL);
+
+    fflush(stdout);
+    double start = now();
+    for(uint32_t i = 0;i < workers;i++){
+        Worker *w = &batch.workers[i];
+        w->batch = &batch;
+        w->id = i;
+        pthread_mutex_init(&w->deque.lock, NULL);
+        w->deque.top = (uint64_t)count * i / workers;
+        w->deque.bottom = (uint64_t)count * (i + 1) / workers;
+    }
+    uint32_t started = 0;
+    for(;started < workers;started++){
+        if(pthread_create(&batch.workers[started].thread, NULL, work, &batch.workers[started]) != 0)
+            break;
+    }
+    // The main thread helps with the jobs of the workers which
+    // could not be started
+    if(started < workers)
+        work(&batch.workers[started]);
+    for(uint32_t i = 0;i < started;i++)
+        pthread_join(batch.workers[i].thread, NULL);
+    double elapsed = now() - start;
+
+    uint32_t failed = 0, faulted = 0, steals = 0;
+    uint64_t retired = 0;
+    for(uint32_t i = 0;i < count;i++){
+        Job *job = &batch.jobs[i];
+        pblue(ANSI_FONT_BOLD "\n[%s]\n", job->file);
+        if(job->output != NULL)
+            fwrite(job->output, 1, job->outputSize, stdout);
+        printf("\n");
+        free(job->output);
+        failed += !job->loaded;
+        faulted += job->loaded && job->status == RM_FAULT;
+        retired += job->retired;
+    }
+    for(uint32_t i = 0;i < workers;i++){
+        steals += batch.workers[i].steals;
+        pthread_mutex_destroy(&batch.workers[i].deque.lock);
+        // before the snapshots they were spawned from
+        for(uint32_t j = 0;j < batch.workers[i].keptCount;j++){
+            rm_free(batch.workers[i].kept[j].machine);
+            release(&batch, batch.workers[i].kept[j].image);
+        }
+    }
+
+    pblue(ANSI_FONT_BOLD "\nPrograms\t");
+    pgrn("%" PRIu32 " (%" PRIu32 " failed to load, %" PRIu32 " faulted)\n", count, failed, faulted);
+    pblue(ANSI_FONT_BOLD "Workers\t\t");
+    pgrn("%" PRIu32 " (%" PRIu32 " steals)\n", workers, steals);
+    pblue(ANSI_FONT_BOLD "Time\t\t");
+    pgrn("%.3f s\n", elapsed);
+    pblue(ANSI_FONT_BOLD "Throughput\t");
+    pgrn("%.1f programs/s, %.0f instructions/s\n", count / elapsed, retired / elapsed);
+
+    for(uint32_t i = 0;i < batch.imageCount;i++)
+        release(&batch, batch.images[i]);
+    pthread_mutex_destroy(&batch.imageLock);
+    free(batch.jobs);
+    free(batch.workers);
+    return failed == 0;
+}
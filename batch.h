@@ -0,0 +1,10 @@
+#pragma once
+#include "rm_common.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Runs each of the files, sources or executables, in its own
+// machine on a pool of workers, and reports the throughput.
+// Zero workers means one per online core. Returns false if any
+// of the programs could not be loaded.
+bool batch_run(char **files, uint32_t count, uint32_t workers, bool useJit);
@@ -0,0 +1,317 @@
+#include "bench.h"
+#include "vm.h"
+#include "lexer.h"
+#include "parser.h"
+#include "display.h"
+#include "jit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* Benchmarks
+ * ==========
+ *
+ * Each workload is a guest program, either one of tests/, or a
+ * large one which is generated here. It runs BENCH_RUNS times,
+ * each time in a process of its own, so that the peak RSS which
+ * the kernel reports for the process is that of the workload
+ * alone. Only rm_run is timed, and the fastest run is kept. The
+ * output of the program goes to /dev/null.
+ *
+ * The results are saved as JSON, with a workload on each line.
+ * Only this reads them back, as a baseline, so a line is only
+ * searched for the fields it needs.
+ */
+
+// Runs of each workload, the fastest of which is reported
+#define BENCH_RUNS 5
+
+typedef struct{
+    char *data;
+    size_t size, capacity;
+} Source;
+
+// Appends to a generated source, false if it could not grow
+static bool append(Source *source, const char *format, ...){
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if(length < 0)
+        return false;
+    if(source->size + length + 1 > source->capacity){
+        size_t grown = source->capacity == 0 ? 4096 : source->capacity * 2;
+        while(grown < source->size + length + 1)
+            grown *= 2;
+        char *moved = (char *)realloc(source->data, grown);
+        if(moved == NULL)
+            return false;
+        source->data = moved;
+        source->capacity = grown;
+    }
+    va_start(args, format);
+    vsnprintf(source->data + source->size, length + 1, format, args);
+    va_end(args);
+    source->size += length;
+    return true;
+}
+
+// A loop around a straight run of 60000 instructions, all of
+// which the decoder keeps records for at once
+static char* straight(){
+    Source source = {NULL, 0, 0};
+    bool ok = append(&source, "mov #1000, r7\nagain : ");
+    for(uint32_t i = 0;ok && i < 20000;i++)
+        ok = append(&source, "add r0, #%" PRIu32 "\nrcopy r0, r1\nand r1, #%" PRIu32 "\n", i, i | 1);
+    ok = ok && append(&source, "loop r7, @again\nstore r0, @result\nprint @result\nhalt\nresult : const #0\n");
+    if(!ok){
+        free(source.data);
+        return NULL;
+    }
+    return source.data;
+}
+
+// Labels can not hold digits, so the routines are named fnaaa,
+// fnaab and so on
+static const char* routine(uint32_t i){
+    static char name[6] = "fn";
+    name[2] = 'a' + i / (26 * 26) % 26;
+    name[3] = 'a' + i / 26 % 26;
+    name[4] = 'a' + i % 26;
+    return name;
+}
+
+// A loop which calls each of 5000 small routines in turn
+static char* calls(){
+    Source source = {NULL, 0, 0};
+    bool ok = append(&source, "mov #2000, r7\nagain : ");
+    for(uint32_t i = 0;ok && i < 5000;i++)
+        ok = append(&source, "call @%s\n", routine(i));
+    ok = ok && append(&source, "loop r7, @again\nstore r0, @result\nprint @result\nhalt\n");
+    for(uint32_t i = 0;ok && i < 5000;i++)
+        ok = append(&source, "%s : add r0, #%" PRIu32 "\nret\n", routine(i), i);
+    ok = ok && append(&source, "result : const #0\n");
+    if(!ok){
+        free(source.data);
+        return NULL;
+    }
+    return source.data;
+}
+
+typedef struct{
+    const char *name;
+    const char *file; // in tests/, or NULL if it is generated
+    char* (*generate)();
+} Workload;
+
+static const Workload workloads[] = {
+    {"tight_loop", "tests/immloopbench.rm", NULL},
+    {"count_down", "tests/countloopbench.rm", NULL},
+    {"memory_copy", "tests/copyloopbench.rm", NULL},
+    {"output", "tests/outputbench.rm", NULL},
+    {"branchy", "tests/branchbench.rm", NULL},
+    {"generated_straight", NULL, straight},
+    {"generated_calls", NULL, calls}
+};
+
+#define WORKLOADS (sizeof(workloads) / sizeof(Workload))
+
+// What a run sends back to the benchmark
+typedef struct{
+    bool halted;
+    uint64_t retired;
+    double seconds;
+} Measurement;
+
+typedef struct{
+    Measurement best;
+    long peakRss; // kilobytes
+} Result;
+
+static char* read_file(const char *fileName){
+    FILE *f = fopen(fileName, "rb");
+    if(!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    long length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *buffer = length < 0 ? NULL : (char *)malloc(length + 1);
+    if(buffer){
+        length = fread(buffer, 1, length, f);
+        buffer[length] = '\0';
+    }
+    fclose(f);
+    return buffer;
+}
+
+static double now(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// A run, in the process forked for it
+static Measurement measure(const char *source, bool useJit, uint8_t variant){
+    Measurement m = {false, 0, 0};
+    VirtualMachine *machine = rm_new();
+    TokenList l = tokens_scan(source);
+    bool loaded = l.hasError == 0 && rm_init(machine, 0)
+        && parse_and_emit(l, &machine->memory, &machine->memSize, 0);
+    tokens_free(l);
+    int null = open("/dev/null", O_WRONLY);
+    if(loaded && null >= 0){
+        output_init_fd(&machine->output, null);
+        if(!rm_variant(machine, machine->variant | variant))
+            err("Unable to change the interpreter, running on the default one!\n");
+        if(useJit && !jit_enable(machine))
+            err("Unable to start the JIT, running on the interpreter!\n");
+        double start = now();
+        m.halted = rm_run(machine, 0) == RM_HALTED;
+        m.seconds = now() - start;
+        m.retired = machine->retired;
+    }
+    rm_free(machine);
+    if(null >= 0)
+        close(null);
+    return m;
+}
+
+static bool run(const char *source, bool useJit, uint8_t variant, Result *result){
+    result->peakRss = 0;
+    for(uint32_t i = 0;i < BENCH_RUNS;i++){
+        int fds[2];
+        if(pipe(fds) != 0)
+            return false;
+        // Or the child prints what is buffered again
+        fflush(stdout);
+        pid_t pid = fork();
+        if(pid < 0){
+            close(fds[0]);
+            close(fds[1]);
+            return false;
+        }
+        if(pid == 0){
+            close(fds[0]);
+            Measurement m = measure(source, useJit, variant);
+            _exit(write(fds[1], &m, sizeof(m)) != sizeof(m));
+        }
+        close(fds[1]);
+        Measurement m;
+        bool got = read(fds[0], &m, sizeof(m)) == sizeof(m);
+        close(fds[0]);
+        int status;
+        struct rusage usage;
+        if(wait4(pid, &status, 0, &usage) != pid || !got || !m.halted)
+            return false;
+        if(i == 0 || m.seconds < result->best.seconds)
+            result->best = m;
+        if(usage.ru_maxrss > result->peakRss)
+            result->peakRss = usage.ru_maxrss;
+    }
+    return true;
+}
+
+// Seconds of the workload in a saved result, 0 if it is not there
+static double baseline_seconds(const char *saved, const char *name){
+    char key[64];
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+    const char *line = strstr(saved, key);
+    if(line == NULL)
+        return 0;
+    const char *end = strchr(line, '\n');
+    const char *field = strstr(line, "\"seconds\": ");
+    double seconds;
+    if(field == NULL || (end != NULL && field > end)
+            || sscanf(field + strlen("\"seconds\": "), "%lf", &seconds) != 1)
+        return 0;
+    return seconds;
+}
+
+static bool save(const char *file, const Result *results, bool useJit, uint8_t variant){
+    FILE *f = fopen(file, "w");
+    if(f == NULL)
+        return false;
+    fprintf(f, "{\n  \"runs\": %d,\n  \"jit\": %s,\n  \"variant\": %" PRIu8 ",\n  \"workloads\": [\n",
+            BENCH_RUNS, useJit ? "true" : "false", variant);
+    for(uint32_t i = 0;i < WORKLOADS;i++){
+        const Result *r = &results[i];
+        fprintf(f, "    {\"name\": \"%s\", \"halted\": %s, \"retired\": %" PRIu64 ", \"seconds\": %.6f, "
+                "\"instructions_per_second\": %.0f, \"peak_rss_kb\": %ld}%s\n",
+                workloads[i].name, r->best.halted ? "true" : "false", r->best.retired, r->best.seconds,
+                r->best.seconds > 0 ? r->best.retired / r->best.seconds : 0, r->peakRss,
+                i + 1 < WORKLOADS ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    return fclose(f) == 0;
+}
+
+bool bench_run(const char *results, const char *baseline, double threshold,
+        bool useJit, uint8_t variant){
+    char *saved = NULL;
+    if(baseline != NULL && (saved = read_file(baseline)) == NULL){
+        err("Unable to read the baseline : "
+                ANSI_COLOR_RED ANSI_FONT_BOLD "%s" ANSI_COLOR_RESET "\n", baseline);
+        return false;
+    }
+
+    Result measured[WORKLOADS];
+    uint32_t failed = 0, regressed = 0;
+    for(uint32_t i = 0;i < WORKLOADS;i++){
+        const Workload *w = &workloads[i];
+        Result *r = &measured[i];
+        memset(r, 0, sizeof(Result));
+        pblue(ANSI_FONT_BOLD "\n[%s]\n", w->name);
+        char *source = w->file != NULL ? read_file(w->file) : w->generate();
+        if(source == NULL || !run(source, useJit, variant, r)){
+            err("Unable to run the workload!\n");
+            free(source);
+            r->best.halted = false;
+            failed++;
+            continue;
+        }
+        free(source);
+        pblue(ANSI_FONT_BOLD "Instructions\t");
+        pgrn("%" PRIu64 "\n", r->best.retired);
+        pblue(ANSI_FONT_BOLD "Time\t\t");
+        pgrn("%.3f s\n", r->best.seconds);
+        pblue(ANSI_FONT_BOLD "Throughput\t");
+        pgrn("%.0f instructions/s\n", r->best.retired / r->best.seconds);
+        pblue(ANSI_FONT_BOLD "Peak RSS\t");
+        pgrn("%ld KB\n", r->peakRss);
+        if(saved == NULL)
+            continue;
+        double base = baseline_seconds(saved, w->name);
+        if(base <= 0){
+            warn("No baseline for the workload!");
+            continue;
+        }
+        double change = (r->best.seconds / base - 1) * 100;
+        pblue(ANSI_FONT_BOLD "Baseline\t");
+        if(change > threshold){
+            pred(ANSI_FONT_BOLD "%.3f s, %+.1f%% slower than it\n", base, change);
+            regressed++;
+        }
+        else
+            pgrn("%.3f s, %+.1f%%\n", base, change);
+    }
+    free(saved);
+
+    if(results != NULL && !save(results, measured, useJit, variant)){
+        err("Unable to save the results to given file!\n");
+        return false;
+    }
+    pblue(ANSI_FONT_BOLD "\nWorkloads\t");
+    pgrn("%zu (%" PRIu32 " failed", WORKLOADS, failed);
+    if(baseline != NULL)
+        pgrn(", %" PRIu32 " regressed by more than %.1f%%", regressed, threshold);
+    pgrn(")\n");
+    return failed == 0 && regressed == 0;
+}
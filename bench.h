@@ -0,0 +1,18 @@
+#pragma once
+#include "rm_common.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Regression, in percent of the time of the baseline, above which
+// a workload is flagged, unless another one is given
+#define BENCH_THRESHOLD 10.0
+
+// Runs the benchmark workloads on machines of the given RunVariant
+// flags, and reports the instructions they retire per second, their
+// time and their peak RSS. The results are saved as JSON to results,
+// and compared with those saved to baseline by an earlier run, either
+// of which may be NULL. The workloads in tests/ are read from the
+// present directory. Returns false if any of them did not halt, or
+// got slower than the baseline by more than threshold percent.
+bool bench_run(const char *results, const char *baseline, double threshold,
+        bool useJit, uint8_t variant);
@@ -1,11 +1,14 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <inttypes.h>
 #include "display.h"
 #include "vm.h"
 #include "bytecode.h"
+#include "verifier.h"
 
 void bc_write_byte(uint8_t *memory, uint32_t *offset, uint8_t data){
     memory[*offset] = data;
@@ -29,8 +32,26 @@ static uint8_t instructionLength[] = {
  * Bytecode VERSION -->  8 bits
  * core bytecode length excluding header and footer --> 32 bits
  * HEADER --> 32 bits
- * core bytecode
+ * core bytecode, from offset 13 of the file
  * FOOTER --> 32 bits
+ *
+ * Followed by an optional debug section, which maps offsets
+ * of the code back to the source
+ * DEBUG --> 32 bits
+ * number of lines --> 32 bits
+ * offset and line of each statement --> 32 + 32 bits
+ * number of labels --> 32 bits
+ * offset, name length and name of each label --> 32 + 32 bits + name
+ * FOOTER --> 32 bits
+ *
+ * The fields are little endian. The bytecode itself is the memory
+ * of the machine as the guest sees it, and its operands stay big
+ * endian and unaligned like the rest of its longs, since programs
+ * load and patch them.
+ *
+ * Version 2 only changes the header : version 1 wrote the fields
+ * in the byte order of the host which wrote them. Such files are
+ * still read, and are written as version 2.
  */
 
 typedef struct{
@@ -45,9 +66,13 @@ typedef struct{
 #define MAGIC 0x726c6d63 // rlmc
 #define HEADER 0x62737274 // bsrt
 #define FOOTER 0x62656e64 // bend
+#define DEBUG_SECTION 0x62646267 // bdbg
 
 // This will change if the bytecode format is updated
-#define CURRENT_EXECUTABLE_VERSION 0x1
+#define CURRENT_EXECUTABLE_VERSION 0x2
+
+// Offset of the core bytecode in the file
+#define CODE_START 13
 
 #ifdef DEBUG
 #define SHOW_FAIL(x, str) {\
@@ -73,8 +98,65 @@ typedef struct{
     } \
     DONEMSG();
 
+// A field of the file, in the byte order of its version
+static uint32_t fieldOf(const uint8_t *bytes, uint8_t version){
+    uint32_t val;
+    if(version == 1){
+        memcpy(&val, bytes, 4);
+        return val;
+    }
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static bool readField(FILE *opn, uint8_t version, uint32_t *val){
+    uint8_t bytes[4];
+    if(fread(bytes, 4, 1, opn) != 1)
+        return false;
+    *val = fieldOf(bytes, version);
+    return true;
+}
+
+static void writeField(FILE *save, uint32_t val){
+    uint8_t bytes[4] = {val, val >> 8, val >> 16, val >> 24};
+    fwrite(bytes, 4, 1, save);
+}
+
+// Reads the debug section at the present position of the file into
+// map, checking that its entries are in order and inside the code
+static bool readDebug(FILE *opn, uint8_t version, uint32_t length, SourceMap *map){
+    uint32_t magic, count, offset, line, previous = 0;
+    if(!readField(opn, version, &magic) || magic != DEBUG_SECTION)
+        return false;
+    if(!readField(opn, version, &count))
+        return false;
+    for(uint32_t i = 0;i < count;i++){
+        if(!readField(opn, version, &offset) || !readField(opn, version, &line)
+                || offset > length || (i > 0 && offset <= previous)
+                || !sourcemap_add_line(map, offset, line))
+            return false;
+        previous = offset;
+    }
+    if(!readField(opn, version, &count))
+        return false;
+    for(uint32_t i = 0;i < count;i++){
+        uint32_t nameLength;
+        if(!readField(opn, version, &offset) || !readField(opn, version, &nameLength)
+                || offset > length || (i > 0 && offset < previous) || nameLength > 4096)
+            return false;
+        char name[4097];
+        if(fread(name, 1, nameLength, opn) != nameLength)
+            return false;
+        name[nameLength] = '\0';
+        if(!sourcemap_add_label(map, offset, name))
+            return false;
+        previous = offset;
+    }
+    return readField(opn, version, &magic) && magic == FOOTER && fgetc(opn) == EOF;
+}
 
-Data bc_read_from_disk(const char *inputFile){
+Data bc_read_from_disk(const char *inputFile, SourceMap *map){
+    Bytecode bc;
+    bc.code = NULL;
     FILE *opn = fopen(inputFile, "rb");
     if(!opn){
         err("Unable to open file for reading : " ANSI_COLOR_RED ANSI_FONT_BOLD 
@@ -87,41 +169,71 @@ Data bc_read_from_disk(const char *inputFile){
 #ifdef DEBUG
     dbg("File size : " ANSI_COLOR_CYAN ANSI_FONT_BOLD "%ld" ANSI_COLOR_RESET " bytes\n", size);
 #endif
-    if(size < 18){ // 21 for metadata, atleast 1 opcode
+    if(size < 18){ // 17 for metadata of version 1, atleast 1 opcode
         err("Size of the executable is less than expected!");
             goto stopread;
     }
-    Bytecode bc;
-    bc.code = NULL;
 
-    fread(&bc.magic, 4, 1, opn);
+    uint8_t magic[4];
+    fread(magic, 4, 1, opn);
     fread(&bc.version, 1, 1, opn);
-    fread(&bc.length, 4, 1, opn);
-    fread(&bc.header, 4, 1, opn);
 
 #ifdef DEBUG
     dbg("===== Verifying File Metadata =====");
 #endif
 
+    if(bc.version != 1 && bc.version != CURRENT_EXECUTABLE_VERSION){
+        err("This version of the executable is not supported by the program!");
+        goto stopread;
+    }
+    bc.magic = fieldOf(magic, bc.version);
     VERIFY(MAGIC, bc.magic, "Magic", "Not a valid RealMachine executable!");
-    VERIFY(CURRENT_EXECUTABLE_VERSION, bc.version, "Version", "This version of the executable is "
-            "not supported by the program!");
-    VERIFY(bc.length + 17, size, "Total size", "The executable is corrupted!");
+    fseek(opn, CODE_START - 8, SEEK_SET);
+    if(!readField(opn, bc.version, &bc.length) || !readField(opn, bc.version, &bc.header)){
+        err("The executable is corrupted!");
+        goto stopread;
+    }
+    // A debug section may follow the footer
+    if(bc.length > (uint64_t)size - CODE_START - 4){
+        err("The executable is corrupted!");
+        goto stopread;
+    }
     VERIFY(HEADER, bc.header, "Header", "The executable is corrupted!");
     
     fseek(opn, bc.length, SEEK_CUR);
-    fread(&bc.footer, 4, 1, opn);
+    readField(opn, bc.version, &bc.footer);
     
     VERIFY(FOOTER, bc.footer, "Footer", "The executable is corrupted!");
 
+    if(CODE_START + bc.length + 4 != size){
+        SourceMap debug;
+        sourcemap_init(&debug);
+        bool valid = readDebug(opn, bc.version, bc.length, &debug);
+        if(valid && map != NULL){
+            sourcemap_free(map);
+            *map = debug;
+        }
+        else
+            sourcemap_free(&debug);
+        if(!valid){
+            err("The debug section of the executable is corrupted!");
+            goto stopread;
+        }
+    }
+
 #ifdef DEBUG
     dbg("Reading bytecode");
 #endif
 
     // Everything is good
-    fseek(opn, 13, SEEK_SET);
+    fseek(opn, CODE_START, SEEK_SET);
     bc.code = (uint8_t *)malloc(sizeof(uint8_t) * (bc.length+1));
     fread(bc.code, bc.length, 1, opn);
+    if(!verify_program(bc.code, bc.length)){
+        err("The executable failed verification!");
+        free(bc.code);
+        bc.code = NULL;
+    }
 
 #ifdef DEBUG
     dbg("Read complete!\n");
@@ -132,7 +244,18 @@ stopread:
     return (Data){bc.code, bc.code == NULL ? 0 : bc.length};
 }
 
-bool bc_save_to_disk(const char *outputFile, uint8_t *memory, uint32_t size){ 
+// Whether the file starts with the magic of an executable
+bool bc_is_executable(const char *inputFile){
+    FILE *opn = fopen(inputFile, "rb");
+    if(!opn)
+        return false;
+    uint8_t magic[4];
+    bool ret = fread(magic, 4, 1, opn) == 1 && (fieldOf(magic, 1) == MAGIC || fieldOf(magic, 2) == MAGIC);
+    fclose(opn);
+    return ret;
+}
+
+bool bc_save_to_disk(const char *outputFile, uint8_t *memory, uint32_t size, const SourceMap *map){
     FILE *save = fopen(outputFile, "w");
     if(!save){
         err("Unable to open file for saving : " ANSI_COLOR_RED ANSI_FONT_BOLD "%s" ANSI_COLOR_RESET " !\n", outputFile);
@@ -148,7 +271,7 @@ bool bc_save_to_disk(const char *outputFile, uint8_t *memory, uint32_t size){
     bc.version = CURRENT_EXECUTABLE_VERSION;
 
 #ifdef DEBUG
-    dbg("File size : " ANSI_FONT_BOLD ANSI_COLOR_CYAN "%ld" ANSI_COLOR_RESET " bytes\n", size+17);
+    dbg("File size : " ANSI_FONT_BOLD ANSI_COLOR_CYAN "%ld" ANSI_COLOR_RESET " bytes\n", size + CODE_START + 4);
     dbg("===== Writing File Metadata =====");
     dbg("Magic : 0x%x", bc.magic);
     dbg("Version : 0x%x", bc.version);
@@ -157,18 +280,35 @@ bool bc_save_to_disk(const char *outputFile, uint8_t *memory, uint32_t size){
     dbg("Footer : 0x%x", bc.footer);
 #endif
 
-    fwrite(&bc.magic, 4, 1, save);
+    writeField(save, bc.magic);
     fwrite(&bc.version, 1, 1, save);
-    fwrite(&bc.length, 4, 1, save);
-    fwrite(&bc.header, 4, 1, save);
+    writeField(save, bc.length);
+    writeField(save, bc.header);
     fwrite(bc.code, size, 1, save);
-    fwrite(&bc.footer, 4, 1, save);
-    fclose(save);
-    return true;
+    writeField(save, bc.footer);
+
+    if(map != NULL){
+        writeField(save, DEBUG_SECTION);
+        writeField(save, map->lineCount);
+        for(uint32_t i = 0;i < map->lineCount;i++){
+            writeField(save, map->lines[i].offset);
+            writeField(save, map->lines[i].line);
+        }
+        writeField(save, map->labelCount);
+        for(uint32_t i = 0;i < map->labelCount;i++){
+            uint32_t nameLength = strlen(map->labels[i].name);
+            writeField(save, map->labels[i].offset);
+            writeField(save, nameLength);
+            fwrite(map->labels[i].name, 1, nameLength, save);
+        }
+        writeField(save, bc.footer);
+    }
+    bool written = !ferror(save);
+    return fclose(save) == 0 && written;
 }
 
 void bc_write_op(uint8_t *memory, uint32_t *offset, int opcode, ...){
-    if(opcode == OP_const || opcode == OP_str)
+    if(opcode == OP_const || opcode == OP_str || opcode == OP_space)
         (*offset)--;
     else
         memory[*offset] = opcode;
@@ -309,9 +449,440 @@ void bc_write_op(uint8_t *memory, uint32_t *offset, int opcode, ...){
                          WRITE_LONG(*offset + 4, bytes);
                          break;
                        }
-
+        case OP_space:{
+                         uint32_t bytes = va_arg(args, uint32_t);
+                         memset(&memory[*offset + 1], 0, bytes);
+                         *offset += bytes;
+                         break;
+                      }
+        case OP_bcopy:
+        case OP_vadd:
+        case OP_vsub:
+        case OP_vmul:
+        case OP_vand:
+        case OP_vor:{
+                         uint32_t from = va_arg(args, uint32_t);
+                         uint32_t to = va_arg(args, uint32_t);
+                         WRITE_LONG(*offset, from);
+                         WRITE_LONG(*offset + 4, to);
+                         memory[*offset + 9] = va_arg(args, int);
+                         break;
+                      }
+        case OP_bfill:{
+                         memory[*offset + 1] = va_arg(args, int);
+                         uint32_t to = va_arg(args, uint32_t);
+                         WRITE_LONG(*offset + 1, to);
+                         memory[*offset + 6] = va_arg(args, int);
+                         break;
+                      }
+        case OP_vsum:
+        case OP_vmin:
+        case OP_vmax:{
+                        uint32_t from = va_arg(args, uint32_t);
+                        WRITE_LONG(*offset, from);
+                        memory[*offset + 5] = va_arg(args, int);
+                        memory[*offset + 6] = va_arg(args, int);
+                        break;
+                     }
+        case OP_bcmp:{
+                        uint32_t a = va_arg(args, uint32_t);
+                        uint32_t b = va_arg(args, uint32_t);
+                        WRITE_LONG(*offset, a);
+                        WRITE_LONG(*offset + 4, b);
+                        memory[*offset + 9] = va_arg(args, int);
+                        memory[*offset + 10] = va_arg(args, int);
+                        break;
+                     }
+        case OP_addb:
+        case OP_addw:
+        case OP_subb:
+        case OP_subw:
+        case OP_andb:
+        case OP_andw:
+        case OP_orb:
+        case OP_orw:
+                     memory[*offset + 1] = va_arg(args, int);
+                     memory[*offset + 2] = va_arg(args, int);
+                     break;
+        case OP_movb:
+                     memory[*offset + 1] = va_arg(args, int);
+                     memory[*offset + 2] = va_arg(args, int);
+                     break;
+        case OP_movw:{
+                        uint32_t val = va_arg(args, uint32_t);
+                        memory[*offset + 1] = val >> 8;
+                        memory[*offset + 2] = val;
+                        memory[*offset + 3] = va_arg(args, int);
+                        break;
+                     }
+        case OP_loadb:
+        case OP_loadw:{
+                         uint32_t val = va_arg(args, uint32_t);
+                         WRITE_LONG(*offset, val);
+                         memory[*offset + 5] = va_arg(args, int);
+                         break;
+                     }
+        case OP_storeb:
+        case OP_storew:{
+                          memory[*offset + 1] = va_arg(args, int);
+                          uint32_t val = va_arg(args, uint32_t);
+                          WRITE_LONG(*offset + 1, val);
+                          break;
+                      }
+        case OP_loadr:{
+                         memory[*offset + 1] = va_arg(args, int);
+                         uint32_t val = va_arg(args, uint32_t);
+                         WRITE_LONG(*offset + 1, val);
+                         memory[*offset + 6] = va_arg(args, int);
+                         break;
+                     }
+        case OP_loadx:{
+                         memory[*offset + 1] = va_arg(args, int);
+                         memory[*offset + 2] = va_arg(args, int);
+                         uint32_t val = va_arg(args, uint32_t);
+                         WRITE_LONG(*offset + 2, val);
+                         memory[*offset + 7] = va_arg(args, int);
+                         break;
+                     }
+        case OP_storer:{
+                          memory[*offset + 1] = va_arg(args, int);
+                          memory[*offset + 2] = va_arg(args, int);
+                          uint32_t val = va_arg(args, uint32_t);
+                          WRITE_LONG(*offset + 2, val);
+                          break;
+                      }
+        case OP_storex:{
+                          memory[*offset + 1] = va_arg(args, int);
+                          memory[*offset + 2] = va_arg(args, int);
+                          memory[*offset + 3] = va_arg(args, int);
+                          uint32_t val = va_arg(args, uint32_t);
+                          WRITE_LONG(*offset + 3, val);
+                          break;
+                      }
+        case OP_printr:{
+                          memory[*offset + 1] = va_arg(args, int);
+                          uint32_t val = va_arg(args, uint32_t);
+                          WRITE_LONG(*offset + 1, val);
+                          break;
+                      }
+        case OP_printx:{
+                          memory[*offset + 1] = va_arg(args, int);
+                          memory[*offset + 2] = va_arg(args, int);
+                          uint32_t val = va_arg(args, uint32_t);
+                          WRITE_LONG(*offset + 2, val);
+                          break;
+                      }
+        case OP_addi:
+        case OP_subi:
+        case OP_muli:
+        case OP_divi:
+        case OP_andi:
+        case OP_ori:{
+                        memory[*offset + 1] = va_arg(args, int);
+                        uint32_t val = va_arg(args, uint32_t);
+                        WRITE_LONG(*offset + 1, val);
+                        break;
+                    }
+        case OP_jeqi:
+        case OP_jnei:
+        case OP_jgti:
+        case OP_jlti:{
+                        memory[*offset + 1] = va_arg(args, int);
+                        uint32_t val = va_arg(args, uint32_t);
+                        WRITE_LONG(*offset + 1, val);
+                        val = va_arg(args, uint32_t);
+                        WRITE_LONG(*offset + 5, val);
+                        break;
+                    }
+        case OP_lshiftr:
+        case OP_rshiftr:
+                    memory[*offset + 1] = va_arg(args, int);
+                    memory[*offset + 2] = va_arg(args, int);
+                    break;
+        case OP_call:{
+                        uint32_t val = va_arg(args, uint32_t);
+                        WRITE_LONG(*offset, val);
+                        break;
+                    }
+        case OP_push:
+        case OP_pop:
+                    memory[*offset + 1] = va_arg(args, int);
+                    break;
+        case OP_ret:
+                    break;
+        case OP_loop:
+        case OP_djnz:{
+                        memory[*offset + 1] = va_arg(args, int);
+                        uint32_t val = va_arg(args, uint32_t);
+                        WRITE_LONG(*offset + 1, val);
+                        break;
+                    }
     }
     *offset += instructionLength[opcode];
     va_end(args);
 #undef WRITE_LONG
 }
+
+bool bc_decode_op(const uint8_t *memory, uint32_t offset, uint32_t size, Operation *op){
+    if(offset >= size || memory[offset] >= sizeof(instructionLength))
+        return false;
+
+    op->opcode = (Code)memory[offset];
+    op->length = instructionLength[op->opcode];
+    op->reg[0] = op->reg[1] = op->reg[2] = 0;
+    op->val[0] = op->val[1] = 0;
+
+    if(size - offset < op->length)
+        return false;
+
+#define READ_LONG(o) bc_read_long(&memory[o])
+// A sub-register, or an index register, with its lane or its
+// shift in the upper half, which goes in val
+#define SUBREGISTER(o, i) \
+    op->reg[i] = memory[o] & 0x0f; \
+    op->val[i] = memory[o] >> 4;
+
+    switch(op->opcode){
+        case OP_add:
+        case OP_sub:
+        case OP_mul:
+        case OP_div:
+        case OP_and:
+        case OP_or:
+        case OP_rcopy:
+            op->reg[0] = memory[offset + 1];
+            op->reg[1] = memory[offset + 2];
+            break;
+        case OP_not:
+        case OP_incr:
+        case OP_decr:
+            op->reg[0] = memory[offset + 1];
+            break;
+        case OP_lshift:
+        case OP_rshift:
+        case OP_store:
+            op->reg[0] = memory[offset + 1];
+            op->val[0] = READ_LONG(offset + 2);
+            break;
+        case OP_load:
+        case OP_mov:
+            op->val[0] = READ_LONG(offset + 1);
+            op->reg[0] = memory[offset + 5];
+            break;
+        case OP_save:
+        case OP_mcopy:
+        case OP_prints:
+            op->val[0] = READ_LONG(offset + 1);
+            op->val[1] = READ_LONG(offset + 5);
+            break;
+        case OP_print:
+        case OP_printc:
+        case OP_jmp:
+            op->val[0] = READ_LONG(offset + 1);
+            break;
+        case OP_jeq:
+        case OP_jne:
+        case OP_jgt:
+        case OP_jlt:
+            op->reg[0] = memory[offset + 1];
+            op->reg[1] = memory[offset + 2];
+            op->val[0] = READ_LONG(offset + 3);
+            break;
+        case OP_jov:
+        case OP_jun:
+            op->val[0] = READ_LONG(offset + 1);
+            break;
+        case OP_halt:
+        case OP_clrpc:
+        case OP_clrsr:
+        case OP_nex:
+            break;
+        case OP_bcopy:
+        case OP_vadd:
+        case OP_vsub:
+        case OP_vmul:
+        case OP_vand:
+        case OP_vor:
+            op->val[0] = READ_LONG(offset + 1);
+            op->val[1] = READ_LONG(offset + 5);
+            op->reg[0] = memory[offset + 9];
+            break;
+        case OP_bfill:
+            op->reg[0] = memory[offset + 1];
+            op->val[0] = READ_LONG(offset + 2);
+            op->reg[1] = memory[offset + 6];
+            break;
+        case OP_vsum:
+        case OP_vmin:
+        case OP_vmax:
+            op->val[0] = READ_LONG(offset + 1);
+            op->reg[0] = memory[offset + 5];
+            op->reg[1] = memory[offset + 6];
+            break;
+        case OP_bcmp:
+            op->val[0] = READ_LONG(offset + 1);
+            op->val[1] = READ_LONG(offset + 5);
+            op->reg[0] = memory[offset + 9];
+            op->reg[1] = memory[offset + 10];
+            break;
+        case OP_addb:
+        case OP_addw:
+        case OP_subb:
+        case OP_subw:
+        case OP_andb:
+        case OP_andw:
+        case OP_orb:
+        case OP_orw:
+            SUBREGISTER(offset + 1, 0);
+            SUBREGISTER(offset + 2, 1);
+            break;
+        case OP_movb:
+            op->val[0] = memory[offset + 1];
+            SUBREGISTER(offset + 2, 1);
+            op->reg[0] = op->reg[1];
+            op->reg[1] = 0;
+            break;
+        case OP_movw:
+            op->val[0] = (memory[offset + 1] << 8) | memory[offset + 2];
+            SUBREGISTER(offset + 3, 1);
+            op->reg[0] = op->reg[1];
+            op->reg[1] = 0;
+            break;
+        case OP_loadb:
+        case OP_loadw:
+            op->val[0] = READ_LONG(offset + 1);
+            SUBREGISTER(offset + 5, 1);
+            op->reg[0] = op->reg[1];
+            op->reg[1] = 0;
+            break;
+        case OP_storeb:
+        case OP_storew:
+            op->val[0] = READ_LONG(offset + 2);
+            SUBREGISTER(offset + 1, 1);
+            op->reg[0] = op->reg[1];
+            op->reg[1] = 0;
+            break;
+        case OP_loadr:
+            op->reg[0] = memory[offset + 1];
+            op->val[0] = READ_LONG(offset + 2);
+            op->reg[1] = memory[offset + 6];
+            break;
+        case OP_loadx:
+            op->reg[0] = memory[offset + 1];
+            SUBREGISTER(offset + 2, 1);
+            op->val[0] = READ_LONG(offset + 3);
+            op->reg[2] = memory[offset + 7];
+            break;
+        case OP_storer:
+            op->reg[1] = memory[offset + 1];
+            op->reg[0] = memory[offset + 2];
+            op->val[0] = READ_LONG(offset + 3);
+            break;
+        case OP_storex:
+            op->reg[2] = memory[offset + 1];
+            op->reg[0] = memory[offset + 2];
+            SUBREGISTER(offset + 3, 1);
+            op->val[0] = READ_LONG(offset + 4);
+            break;
+        case OP_printr:
+            op->reg[0] = memory[offset + 1];
+            op->val[0] = READ_LONG(offset + 2);
+            break;
+        case OP_printx:
+            op->reg[0] = memory[offset + 1];
+            SUBREGISTER(offset + 2, 1);
+            op->val[0] = READ_LONG(offset + 3);
+            break;
+        case OP_addi:
+        case OP_subi:
+        case OP_muli:
+        case OP_divi:
+        case OP_andi:
+        case OP_ori:
+            op->reg[0] = memory[offset + 1];
+            op->val[0] = READ_LONG(offset + 2);
+            break;
+        case OP_jeqi:
+        case OP_jnei:
+        case OP_jgti:
+        case OP_jlti:
+            // The target goes first, like for the other jumps
+            op->reg[0] = memory[offset + 1];
+            op->val[1] = READ_LONG(offset + 2);
+            op->val[0] = READ_LONG(offset + 6);
+            break;
+        case OP_lshiftr:
+        case OP_rshiftr:
+            op->reg[0] = memory[offset + 1];
+            op->reg[1] = memory[offset + 2];
+            break;
+        case OP_call:
+            op->val[0] = READ_LONG(offset + 1);
+            break;
+        case OP_push:
+        case OP_pop:
+            op->reg[0] = memory[offset + 1];
+            break;
+        case OP_ret:
+            break;
+        case OP_loop:
+            op->reg[0] = memory[offset + 1];
+            op->val[0] = READ_LONG(offset + 2);
+            break;
+        case OP_djnz:
+            op->val[0] = READ_LONG(offset + 2);
+            SUBREGISTER(offset + 1, 1);
+            op->reg[0] = op->reg[1];
+            op->reg[1] = 0;
+            break;
+        case OP_const:
+        case OP_str:
+        case OP_space:
+            // data, never executable
+            return false;
+    }
+#undef SUBREGISTER
+#undef READ_LONG
+
+    switch(op->opcode){
+        // Words have two lanes, and bytes four
+        case OP_addw:
+        case OP_subw:
+        case OP_andw:
+        case OP_orw:
+            if(op->val[0] > 1)
+                return false;
+            // fallthrough
+        case OP_movw:
+        case OP_loadw:
+        case OP_storew:
+            if(op->val[1] > 1)
+                return false;
+            break;
+        case OP_addb:
+        case OP_subb:
+        case OP_andb:
+        case OP_orb:
+            if(op->val[0] > 3)
+                return false;
+            // fallthrough
+        case OP_movb:
+        case OP_loadb:
+        case OP_storeb:
+        case OP_djnz:
+            if(op->val[1] > 3)
+                return false;
+            break;
+        // Scales of 1, 2, 4 and 8
+        case OP_loadx:
+        case OP_storex:
+        case OP_printx:
+            if(op->val[1] > 3)
+                return false;
+            break;
+        default:
+            break;
+    }
+
+    return op->reg[0] < 8 && op->reg[1] < 8 && op->reg[2] < 8;
+}
@@ -1,17 +1,64 @@
 #pragma once
 
 #include "rm_common.h"
+#include "vm.h"
+#include "sourcemap.h"
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <string.h>
 
 typedef struct{
     uint8_t *memory;
     uint32_t size;
 } Data;
 
+// An instruction decoded from the bytecode. Register operands
+// are stored in reg, and long operands (immediates, offsets)
+// in val, both in the order they appear in the source. The
+// lanes of sub-registers follow the long operands in val. An
+// indirect address comes first, its base and index in reg, and
+// its displacement and the shift of its scale in val. Jumps
+// keep their target in val[0].
+typedef struct{
+    Code opcode;
+    uint8_t length;
+    uint8_t reg[3];
+    uint32_t val[2];
+} Operation;
+
+// Longs in the memory are big endian. Both of these are a single
+// unaligned load or store, swapped on little endian hosts.
+static inline uint32_t bc_read_long(const uint8_t *at){
+    uint32_t val;
+    memcpy(&val, at, 4);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    val = __builtin_bswap32(val);
+#endif
+    return val;
+}
+
+static inline void bc_write_long(uint8_t *at, uint32_t val){
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    val = __builtin_bswap32(val);
+#endif
+    memcpy(at, &val, 4);
+}
+
+// Whether opcode is a jump which depends on a register, compared
+// with a register or a constant, or counted down
+static inline bool bc_is_conditional(Code opcode){
+    return (opcode >= OP_jeq && opcode <= OP_jlt) || (opcode >= OP_jeqi && opcode <= OP_jlti)
+        || opcode == OP_loop || opcode == OP_djnz;
+}
+
 void bc_write_byte(uint8_t *memory, uint32_t *offset, uint8_t data);
 void bc_copy_arr(uint8_t *memory, uint8_t *data, uint32_t size, uint32_t offset);
-Data bc_read_from_disk(const char *fileName);
-bool bc_save_to_disk(const char *fileName, uint8_t *memory, uint32_t size);
+// Also reads the debug section into map, if the executable has one
+// and map is not NULL
+Data bc_read_from_disk(const char *fileName, SourceMap *map);
+bool bc_is_executable(const char *fileName);
+// Writes a debug section from map, if it is not NULL
+bool bc_save_to_disk(const char *fileName, uint8_t *memory, uint32_t size, const SourceMap *map);
 void bc_write_op(uint8_t *memory, uint32_t *offset, int opcode, ...);
+bool bc_decode_op(const uint8_t *memory, uint32_t offset, uint32_t size, Operation *op);
@@ -1,4 +1,3 @@
-#if defined(DEBUG) || defined(DEBUG_INSTRUCTIONS)
 
 #include "debug.h"
 #include "vm.h"
@@ -28,8 +27,21 @@ void debugRegister(VirtualMachine *machine, uint8_t index){
 #define preg(x) pcyn("r%" PRIu8, READ_BYTE(x))
 #define pmem(x) pylw("@%" PRIu32, READ_LONG(x))
 #define pimm(x) pmgn("#%" PRId32, READ_LONG(x))
+#define psub(x) pcyn("r%" PRIu8 ".%" PRIu8, READ_BYTE(x) & 0x0f, READ_BYTE(x) >> 4)
 #define pcmm() printf(",\t")
 
+// An indirect address, from its base, its index byte if it has
+// one, and its displacement
+static void printAddress(uint8_t *memory, uint32_t base, int64_t index, uint32_t displacement){
+    uint8_t *d = &memory[displacement];
+    int32_t value = ((uint32_t)d[0] << 24) | ((uint32_t)d[1] << 16) | ((uint32_t)d[2] << 8) | d[3];
+    pylw("[r%" PRIu8, memory[base]);
+    if(index >= 0)
+        pylw(" + r%" PRIu8 "*%d", memory[index] & 0x0f, 1 << (memory[index] >> 4));
+    if(value != 0)
+        pylw(" + #%" PRId32, value);
+    pylw("]");
+}
 
 void debugInstruction(uint8_t *memory, uint32_t *offset, uint32_t size){
     if(size <= (*offset) || size <= (*offset) + instructionLength[memory[*offset]]){
@@ -77,6 +89,8 @@ void debugInstruction(uint8_t *memory, uint32_t *offset, uint32_t size){
         case OP_not:
         case OP_incr:
         case OP_decr:
+        case OP_push:
+        case OP_pop:
             preg(*offset + 1);
             break;
         case OP_lshift:
@@ -126,12 +140,14 @@ void debugInstruction(uint8_t *memory, uint32_t *offset, uint32_t size){
         case OP_halt:
         case OP_clrpc:
         case OP_clrsr:
+        case OP_ret:
             break;
         case OP_const:
             pimm(*offset + 1);
             break;
         case OP_nex:
         case OP_str:
+        case OP_space:
             pred("[Error] Code not executable!");
             break;
         case OP_mcopy:
@@ -140,12 +156,147 @@ void debugInstruction(uint8_t *memory, uint32_t *offset, uint32_t size){
             pmem(*offset + 5);
             break;
         case OP_jmp:
+        case OP_call:
             pmem(*offset + 1);
             break;
+        case OP_loop:
+            preg(*offset + 1);
+            pcmm();
+            pmem(*offset + 2);
+            break;
+        case OP_djnz:
+            psub(*offset + 1);
+            pcmm();
+            pmem(*offset + 2);
+            break;
         case OP_prints:
             pmem(*offset + 1);
             pcmm();
             pimm(*offset + 5);
+            break;
+        case OP_bcopy:
+        case OP_vadd:
+        case OP_vsub:
+        case OP_vmul:
+        case OP_vand:
+        case OP_vor:
+            pmem(*offset + 1);
+            pcmm();
+            pmem(*offset + 5);
+            pcmm();
+            preg(*offset + 9);
+            break;
+        case OP_bfill:
+            preg(*offset + 1);
+            pcmm();
+            pmem(*offset + 2);
+            pcmm();
+            preg(*offset + 6);
+            break;
+        case OP_vsum:
+        case OP_vmin:
+        case OP_vmax:
+            pmem(*offset + 1);
+            pcmm();
+            preg(*offset + 5);
+            pcmm();
+            preg(*offset + 6);
+            break;
+        case OP_bcmp:
+            pmem(*offset + 1);
+            pcmm();
+            pmem(*offset + 5);
+            pcmm();
+            preg(*offset + 9);
+            pcmm();
+            preg(*offset + 10);
+            break;
+        case OP_addb:
+        case OP_addw:
+        case OP_subb:
+        case OP_subw:
+        case OP_andb:
+        case OP_andw:
+        case OP_orb:
+        case OP_orw:
+            psub(*offset + 1);
+            pcmm();
+            psub(*offset + 2);
+            break;
+        case OP_movb:
+            pmgn("#%" PRIu32, (uint32_t)READ_BYTE(*offset + 1));
+            pcmm();
+            psub(*offset + 2);
+            break;
+        case OP_movw:
+            pmgn("#%" PRIu32, (uint32_t)READ_WORD(*offset + 1));
+            pcmm();
+            psub(*offset + 3);
+            break;
+        case OP_loadb:
+        case OP_loadw:
+            pmem(*offset + 1);
+            pcmm();
+            psub(*offset + 5);
+            break;
+        case OP_storeb:
+        case OP_storew:
+            psub(*offset + 1);
+            pcmm();
+            pmem(*offset + 2);
+            break;
+        case OP_loadr:
+            printAddress(memory, *offset + 1, -1, *offset + 2);
+            pcmm();
+            preg(*offset + 6);
+            break;
+        case OP_loadx:
+            printAddress(memory, *offset + 1, *offset + 2, *offset + 3);
+            pcmm();
+            preg(*offset + 7);
+            break;
+        case OP_storer:
+            preg(*offset + 1);
+            pcmm();
+            printAddress(memory, *offset + 2, -1, *offset + 3);
+            break;
+        case OP_storex:
+            preg(*offset + 1);
+            pcmm();
+            printAddress(memory, *offset + 2, *offset + 3, *offset + 4);
+            break;
+        case OP_printr:
+            printAddress(memory, *offset + 1, -1, *offset + 2);
+            break;
+        case OP_printx:
+            printAddress(memory, *offset + 1, *offset + 2, *offset + 3);
+            break;
+        case OP_addi:
+        case OP_subi:
+        case OP_muli:
+        case OP_divi:
+        case OP_andi:
+        case OP_ori:
+            preg(*offset + 1);
+            pcmm();
+            pimm(*offset + 2);
+            break;
+        case OP_jeqi:
+        case OP_jnei:
+        case OP_jgti:
+        case OP_jlti:
+            preg(*offset + 1);
+            pcmm();
+            pimm(*offset + 2);
+            pcmm();
+            pmem(*offset + 6);
+            break;
+        case OP_lshiftr:
+        case OP_rshiftr:
+            preg(*offset + 1);
+            pcmm();
+            preg(*offset + 2);
+            break;
     }
     *offset += instructionLength[opcode];
     printf("\n");
@@ -154,5 +305,3 @@ void debugInstruction(uint8_t *memory, uint32_t *offset, uint32_t size){
     #undef READ_WORD
     #undef READ_LONG
 }
-
-#endif
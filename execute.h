@@ -0,0 +1,447 @@
+/* Instance of the interpreter
+ * ===========================
+ *
+ * vm.c includes this once for each variant of execute, with
+ * VARIANT naming it, and CHECKED and TRACED set to 0 or 1. The
+ * checks of a variant which leaves them out fold away, so that
+ * it compiles to the interpreter without them.
+ */
+
+#ifdef REAL_TAIL_CALLS
+#define TAIL(name) VARIANT_NAME(tail_##name)
+
+static RunStatus TAIL(decode)(TAIL_PARAMS);
+#define OPCODE(name, a, b) static RunStatus TAIL(name)(TAIL_PARAMS);
+#define SUPERINSTRUCTION(first, second) static RunStatus TAIL(first##_##second)(TAIL_PARAMS);
+#include "opcodes.h"
+#undef SUPERINSTRUCTION
+#undef OPCODE
+static RunStatus TAIL(native)(TAIL_PARAMS);
+static RunStatus TAIL(backedge)(TAIL_PARAMS);
+static RunStatus TAIL(fault)(TAIL_PARAMS);
+#define OPCODE(name, a, b) static RunStatus TAIL(profile_##name)(TAIL_PARAMS); \
+    static RunStatus TAIL(sample_##name)(TAIL_PARAMS);
+#include "opcodes.h"
+#undef OPCODE
+
+// In the order of Handler
+static const TailHandler TAIL(handlers)[] = {
+    TAIL(decode),
+    #define OPCODE(name, a, b) TAIL(name),
+    #define SUPERINSTRUCTION(first, second) TAIL(first##_##second),
+    #include "opcodes.h"
+    #undef SUPERINSTRUCTION
+    #undef OPCODE
+    TAIL(native),
+    TAIL(backedge),
+    TAIL(fault),
+    #define OPCODE(name, a, b) TAIL(profile_##name),
+    #include "opcodes.h"
+    #undef OPCODE
+    #define OPCODE(name, a, b) TAIL(sample_##name),
+    #include "opcodes.h"
+    #undef OPCODE
+};
+
+#endif
+
+static RunStatus VARIANT_NAME(execute)(VirtualMachine *machine, uint64_t budget){
+    Instruction *code = machine->code;
+    Instruction *ip = &code[machine->PC];
+    uint8_t *memory = machine->memory;
+    RmOutput *output = &machine->output;
+    uint8_t *dirty = machine->dirty;
+    uint64_t retired = machine->retired;
+    uint64_t limit = budget > UINT64_MAX - retired ? UINT64_MAX : retired + budget;
+    machine->limit = limit;
+    int32_t registers[8];
+    memcpy(registers, machine->registers, sizeof(registers));
+    uint32_t *stack = machine->stack;
+    Profile *profile = machine->profile;
+#ifdef REAL_TAIL_CALLS
+    Interpreter state = {machine, code, output, dirty, profile, stack, limit,
+        machine->flagOp, machine->flagA, machine->flagB, machine->SP, .returnTop = 0, .returnCount = 0};
+    Interpreter *in = &state;
+    #define STATE(x) in->x
+#else
+    uint8_t flagOp = machine->flagOp;
+    int32_t flagA = machine->flagA, flagB = machine->flagB;
+    uint32_t sp = machine->SP;
+    // Records which the calls return to, see CASE(ret)
+    Return returns[RETURN_DEPTH];
+    uint32_t returnTop = 0, returnCount = 0;
+    #define STATE(x) x
+#endif
+
+    #undef regl
+    #define regl(index) registers[index]
+
+    // Offset of the present record
+    #define PC_OFFSET ((uint32_t)(ip - code))
+
+    #define SAVE_STATE() \
+        machine->PC = PC_OFFSET; \
+        machine->retired = retired; \
+        memcpy(machine->registers, registers, sizeof(machine->registers)); \
+        machine->flagOp = STATE(flagOp); \
+        machine->flagA = STATE(flagA); \
+        machine->flagB = STATE(flagB); \
+        machine->SP = STATE(sp);
+    #define LOAD_STATE() \
+        ip = &code[machine->PC]; \
+        retired = machine->retired; \
+        memcpy(registers, machine->registers, sizeof(machine->registers)); \
+        STATE(flagOp) = machine->flagOp; \
+        STATE(flagA) = machine->flagA; \
+        STATE(flagB) = machine->flagB; \
+        STATE(sp) = machine->SP;
+    // Also flushes the output, when leaving, and before anything
+    // else is printed
+    #define STOP() \
+        SAVE_STATE(); \
+        output_flush(output);
+
+    // Checked variants check each access, and each record they
+    // dispatch to. A failed read leaves 215 in SR, for the next
+    // check to report.
+    #define CHECK_BOUNDS(x) \
+            if(CHECKED && ((uint32_t)(x) >= machine->memSize || machine->SR == 215)) {\
+                uint32_t y = machine->SR == 215 ? machine->AR : (uint32_t)x; \
+                STOP(); \
+                err("Trying to %s unmapped memory at offset " ANSI_COLOR_RED ANSI_FONT_BOLD \
+                        "%04" PRIu32 ANSI_COLOR_RESET "!\n", \
+                        machine->SR == 215 ? "read from" : "write to", (uint32_t)y); \
+                machine->SR = machine->AR = 0; \
+                return RM_FAULT; \
+            }
+    #define READ_BYTE(x) (CHECKED ? readChecked(machine, memory, x) : memory[x])
+
+    #define READ_WORD(x) ((READ_BYTE(x) << 8) | (READ_BYTE(x + 1)))
+    #define READ_LONG(x) (CHECKED ? ((uint32_t)READ_WORD(x) << 16) | (READ_WORD(x + 2)) \
+            : bc_read_long(&memory[x]))
+
+    // Writes which hit decoded code drop the stale records
+    #define CODE_WRITTEN(x) \
+        { uint32_t m; memcpy(&m, &machine->codeMap[x], 4); \
+            if(m) rm_invalidate(machine, x, 4); }
+
+    // Writes to a clean chunk of a spawned machine mark it, for rm_reset
+    #define PAGE_WRITTEN(x) \
+        if(dirty != NULL && !(dirty[(x) >> DIRTY_SHIFT] && dirty[((x) + 3) >> DIRTY_SHIFT])) \
+            rm_dirty(machine, x, 4);
+
+    #define WRITE_BYTE(x, y) {CHECK_BOUNDS(x); memory[x] = y;}
+    #define WRITE_WORD(x, y) {WRITE_BYTE(x, (y & 0xff00) >> 8); WRITE_BYTE(x + 1, (y & 0xff));}
+    #define WRITE_LONG(x, y) { \
+            if(CHECKED){ \
+                WRITE_WORD(x, (y & 0xffff0000) >> 16); WRITE_WORD(x + 2, (y & 0xffff)); \
+            } \
+            else \
+                bc_write_long(&memory[x], y); \
+            PAGE_WRITTEN(x); CODE_WRITTEN(x);}
+
+
+    // Traced variants print each instruction before it runs
+    #define DEBUG_INS() \
+        if(TRACED){ \
+            STOP(); \
+            uint32_t offs = PC_OFFSET; \
+            debugInstruction(memory, &offs, machine->memSize); \
+            STEP(); \
+        }
+
+    // The present record
+    #define INS (*ip)
+
+    #ifdef REAL_COMPUTED_GOTO
+
+    // Handlers are stored as offsets from the decoder, so that
+    // an all zero record dispatches to it
+    static const int32_t handlers[] = {
+        &&code_decode - &&code_decode,
+        #define OPCODE(name, a, b) &&code_##name - &&code_decode,
+        #define SUPERINSTRUCTION(first, second) &&code_##first##_##second - &&code_decode,
+        #include "opcodes.h"
+        #undef SUPERINSTRUCTION
+        #undef OPCODE
+        &&code_native - &&code_decode,
+        &&code_backedge - &&code_decode,
+        &&code_fault - &&code_decode,
+        #define OPCODE(name, a, b) &&code_profile_##name - &&code_decode,
+        #include "opcodes.h"
+        #undef OPCODE
+        #define OPCODE(name, a, b) &&code_sample_##name - &&code_decode,
+        #include "opcodes.h"
+        #undef OPCODE
+    };
+
+    #define CASE(name) code_##name
+    #define EXECUTE() goto *(&&code_decode + INS.handler)
+    #define DISPATCH() \
+        DEBUG_INS(); \
+        CHECK_BOUNDS(PC_OFFSET); \
+        retired++; \
+        EXECUTE();
+
+    // Continues with the handler of the next record directly,
+    // without going through the dispatcher
+    #define CONTINUE(name) \
+        DEBUG_INS(); \
+        CHECK_BOUNDS(PC_OFFSET); \
+        retired++; \
+        goto code_##name;
+
+    // Goes on to a handler without counting it again
+    #define RESUME(name) goto code_##name
+
+    #define INTERPRET_LOOP DISPATCH()
+
+    #elif defined(REAL_TAIL_CALLS)
+
+    // Each CASE closes the handler before it. The aliases are only
+    // read by the handlers which use them. The memory base stays in
+    // its argument register for the accesses, and only the handlers
+    // which stop the machine leave it unread.
+    #define TAIL_LOCALS \
+        (void)memory; \
+        __attribute__((unused)) VirtualMachine *machine = in->machine; \
+        __attribute__((unused)) Instruction *code = in->code; \
+        __attribute__((unused)) RmOutput *output = in->output; \
+        __attribute__((unused)) uint8_t *dirty = in->dirty; \
+        __attribute__((unused)) Profile *profile = in->profile; \
+        __attribute__((unused)) uint32_t *stack = in->stack; \
+        __attribute__((unused)) uint64_t limit = in->limit;
+    #define CASE(name) } static RunStatus TAIL(name)(TAIL_PARAMS){ TAIL_LOCALS code_##name
+    #define EXECUTE() MUSTTAIL return TAIL(handlers)[INS.handler](in, ip, registers, memory, retired)
+    #define DISPATCH() \
+        DEBUG_INS(); \
+        CHECK_BOUNDS(PC_OFFSET); \
+        retired++; \
+        EXECUTE();
+    #define CONTINUE(name) \
+        DEBUG_INS(); \
+        CHECK_BOUNDS(PC_OFFSET); \
+        retired++; \
+        MUSTTAIL return TAIL(name)(in, ip, registers, memory, retired);
+    #define RESUME(name) MUSTTAIL return TAIL(name)(in, ip, registers, memory, retired)
+
+    // The first handler is called from here, and returns once the
+    // machine stops
+    #define INTERPRET_LOOP \
+        DEBUG_INS(); \
+        CHECK_BOUNDS(PC_OFFSET); \
+        retired++; \
+        return TAIL(handlers)[INS.handler](in, ip, registers, memory, retired);
+
+    #else
+
+    #define CASE(name) case H_##name
+    #define EXECUTE() goto execute
+    #define DISPATCH() goto loop
+    #define CONTINUE(name) DISPATCH()
+    #define RESUME(name) \
+        handler = H_##name; \
+        goto resume
+    int32_t handler;
+    #define INTERPRET_LOOP \
+        loop: \
+        DEBUG_INS(); \
+        CHECK_BOUNDS(PC_OFFSET); \
+        retired++; \
+        execute: \
+        handler = INS.handler; \
+        resume: \
+        switch(handler)
+
+    #endif
+
+    #define INCR_PC(x) ip += x
+    // Taken jumps also charge the budget
+    #define JUMP(x) JUMP_RECORD(&code[x])
+    #define JUMP_RECORD(x) \
+        ip = x; \
+        if(retired >= limit){ \
+            STOP(); \
+            return RM_BUDGET; \
+        }
+
+    // Bodies of the instructions which can begin a superinstruction
+    // Arithmetic records the operation for the status flags, and
+    // wraps around like the host
+    #define EXEC_incr() \
+            STATE(flagOp) = FLAGS_INCR; \
+            STATE(flagA) = regl(INS.r1); \
+            regl(INS.r1) = (uint32_t)STATE(flagA) + 1
+    #define EXEC_decr() \
+            STATE(flagOp) = FLAGS_DECR; \
+            STATE(flagA) = regl(INS.r1); \
+            regl(INS.r1) = (uint32_t)STATE(flagA) - 1
+    #define EXEC_rcopy() regl(INS.r2) = regl(INS.r1)
+    #define EXEC_store() WRITE_LONG(INS.a, regl(INS.r1))
+
+    #define BINARY(x) \
+            regl(INS.r2) = regl(INS.r1) x regl(INS.r2); \
+            INCR_PC(3); \
+            DISPATCH()
+
+    #define ARITHMETIC(x, op) \
+            STATE(flagOp) = op; \
+            STATE(flagA) = regl(INS.r1); \
+            STATE(flagB) = regl(INS.r2); \
+            regl(INS.r2) = (uint32_t)STATE(flagA) x (uint32_t)STATE(flagB); \
+            INCR_PC(3); \
+            DISPATCH()
+
+    #define BICONDITIONAL(x) \
+            if(regl(INS.r1) x regl(INS.r2)){ \
+                JUMP(INS.a); \
+                DISPATCH(); \
+            } \
+            INCR_PC(7); \
+            DISPATCH()
+
+    // The immediate forms, with the constant in a, or in b for
+    // the jumps, which keep their target in a
+    #define BINARY_IMMEDIATE(x) \
+            regl(INS.r1) = regl(INS.r1) x (int32_t)INS.a; \
+            INCR_PC(6); \
+            DISPATCH()
+
+    #define ARITHMETIC_IMMEDIATE(x, op) \
+            STATE(flagOp) = op; \
+            STATE(flagA) = regl(INS.r1); \
+            STATE(flagB) = INS.a; \
+            regl(INS.r1) = (uint32_t)STATE(flagA) x (uint32_t)STATE(flagB); \
+            INCR_PC(6); \
+            DISPATCH()
+
+    #define CONDITIONAL_IMMEDIATE(x) \
+            if(regl(INS.r1) x (int32_t)INS.b){ \
+                JUMP(INS.a); \
+                DISPATCH(); \
+            } \
+            INCR_PC(10); \
+            DISPATCH()
+
+    #define STATUS_JUMP(x) \
+            if(status(STATE(flagOp), STATE(flagA), STATE(flagB), machine->SR) == x) { \
+                JUMP(INS.a); \
+                DISPATCH(); \
+            } \
+            INCR_PC(5); \
+            DISPATCH();
+
+    // The block operations take their length from a register, so
+    // they check their range when they run, once for the block
+    #define BLOCK_RANGE(x, n, write) \
+            if((n) > machine->memSize || (x) > machine->memSize - (n)){ \
+                STOP(); \
+                err("Trying to %s unmapped memory at offset " ANSI_COLOR_RED ANSI_FONT_BOLD \
+                        "%04" PRIu32 ANSI_COLOR_RESET "!\n", (write) ? "write to" : "read from", \
+                        (x) < machine->memSize ? machine->memSize : (x)); \
+                return RM_FAULT; \
+            }
+
+    // Bytes of a run of longs, past the memory if they can not fit
+    #define LONGS(n) ((n) > machine->memSize / 4 ? machine->memSize + 1 : (n) * 4)
+
+    #define VECTOR(op) { \
+            uint32_t count = regl(INS.r1), bytes = LONGS(count); \
+            BLOCK_RANGE(INS.a, bytes, false); \
+            BLOCK_RANGE(INS.b, bytes, true); \
+            vector_apply(op, &memory[INS.b], &memory[INS.a], count); \
+            blockWritten(machine, INS.b, bytes); \
+            INCR_PC(10); \
+            DISPATCH(); \
+        }
+
+    #define REDUCTION(op) { \
+            uint32_t count = regl(INS.r1); \
+            BLOCK_RANGE(INS.a, LONGS(count), false); \
+            regl(INS.r2) = vector_reduce(op, &memory[INS.a], count); \
+            INCR_PC(7); \
+            DISPATCH(); \
+        }
+
+    // Sub-registers, a lane of bits bits of a register
+    #define MASK(bits) ((1u << (bits)) - 1)
+    #define LANE(r, lane, bits) (((uint32_t)regl(r) >> ((lane) * (bits))) & MASK(bits))
+    #define SET_LANE(r, lane, bits, x) \
+            regl(r) = ((uint32_t)regl(r) & ~(MASK(bits) << ((lane) * (bits)))) \
+                | (((uint32_t)(x) & MASK(bits)) << ((lane) * (bits)))
+
+    #define NARROW_BINARY(x, bits) \
+            SET_LANE(INS.r2, INS.b, bits, LANE(INS.r1, INS.a, bits) x LANE(INS.r2, INS.b, bits)); \
+            INCR_PC(3); \
+            DISPATCH()
+
+    // The status of a lane is settled right away, the operation
+    // recorded for the flags is always on whole registers
+    #define NARROW_ARITHMETIC(x, type, bits) { \
+            int32_t result = (type)LANE(INS.r1, INS.a, bits) x (type)LANE(INS.r2, INS.b, bits); \
+            SET_LANE(INS.r2, INS.b, bits, result); \
+            STATE(flagOp) = FLAGS_SETTLED; \
+            machine->SR = result == (type)result ? 0 : result > 0 ? 1 : 2; \
+            INCR_PC(3); \
+            DISPATCH(); \
+        }
+
+    // Indirect addresses wrap around like the host, and are
+    // checked when they are used
+    #define BASED() ((uint32_t)regl(INS.r1) + INS.a)
+    #define INDEXED() ((uint32_t)regl(INS.r1) + ((uint32_t)regl(INS.r2) << INS.b) + INS.a)
+
+    // A full or an empty stack stops the machine like an access
+    // outside the memory
+    #define STACK_FAULT(x) \
+            STOP(); \
+            err("Stack " x " at offset " ANSI_COLOR_RED ANSI_FONT_BOLD \
+                    "%04" PRIu32 ANSI_COLOR_RESET "!\n", PC_OFFSET); \
+            return RM_FAULT;
+
+    #define PUSH(x) \
+            if(STATE(sp) == 0){ \
+                STACK_FAULT("overflow"); \
+            } \
+            stack[--STATE(sp)] = x;
+
+    // The top of the return stack, if it is still on the stack
+    #define RETURN_TOP ((STATE(returnTop) + RETURN_DEPTH - 1) % RETURN_DEPTH)
+    #define RETURN_HIT (STATE(returnCount) > 0 && STATE(returns)[RETURN_TOP].sp == STATE(sp))
+    #define RETURN_DROP() \
+            STATE(returnTop) = RETURN_TOP; \
+            STATE(returnCount)--;
+
+    #define SHIFT(x) \
+            regl(INS.r1) = regl(INS.r1) x INS.a; \
+            INCR_PC(6); \
+            DISPATCH();
+
+    // The host masks the count of the register form, like the JIT
+    #define SHIFT_REGISTER(x) \
+            regl(INS.r1) = regl(INS.r1) x (regl(INS.r2) & 31); \
+            INCR_PC(3); \
+            DISPATCH();
+
+    INTERPRET_LOOP
+#ifndef REAL_TAIL_CALLS
+    {
+        #include "handlers.h"
+    }
+    // Not reached, each handler dispatches or returns
+    return RM_FAULT;
+#endif
+}
+
+#ifdef REAL_TAIL_CALLS
+// Each CASE closes the function before it, this one is opened for
+// the first of them. The labels are only there for the other modes.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-label"
+static inline void TAIL(start)(void){
+#include "handlers.h"
+}
+#pragma GCC diagnostic pop
+#undef TAIL
+#endif
+
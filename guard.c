@@ -0,0 +1,150 @@
+// For the register names of ucontext_t
+#define _GNU_SOURCE
+#include "guard.h"
+
+#ifdef GUARD_MEMORY
+
+#include "display.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#if defined(__linux__) && defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+/* Guard pages
+ * ===========
+ *
+ * The memory is placed at the end of its pages, and followed by
+ * enough inaccessible pages to cover every offset an operand can
+ * encode, plus the width of a long. Any access past the memory
+ * then hits a guard page, and the SIGSEGV handler turns it into
+ * the usual access error, instead of the machine checking each
+ * access. Only the address space is reserved for the guard, so
+ * it costs no memory.
+ */
+
+#if UINTPTR_MAX > 0xffffffffu
+
+// Every 32 bit offset, and the bytes of a long after it
+#define GUARD_SIZE (((size_t)1 << 32) + 4096)
+
+static __thread Guard guard;
+static __thread bool armed = false;
+static pthread_once_t installed = PTHREAD_ONCE_INIT;
+
+static size_t pageSize(){
+    static size_t size = 0;
+    if(size == 0)
+        size = (size_t)sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+static void handler(int sig, siginfo_t *info, void *context){
+    VirtualMachine *machine = guard.machine;
+    uint8_t *address = (uint8_t *)info->si_addr;
+    if(!armed || address < machine->memory
+            || address >= machine->mapping + machine->mappingSize){
+        // Not ours, crash as usual
+        signal(sig, SIG_DFL);
+        return;
+    }
+    machine->AR = (uint32_t)(address - machine->memory);
+    guard.write = false;
+#if defined(__linux__) && defined(__x86_64__)
+    // Bit 1 of the page fault error code is set for writes
+    guard.write = (((ucontext_t *)context)->uc_mcontext.gregs[REG_ERR] & 2) != 0;
+#else
+    (void)context;
+#endif
+    armed = false;
+    siglongjmp(guard.env, 1);
+}
+
+static void install(){
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = handler;
+    // The handler jumps out, so it must not leave SIGSEGV blocked
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, NULL);
+    sigaction(SIGBUS, &action, NULL);
+}
+
+size_t guard_size(){
+    return GUARD_SIZE;
+}
+
+bool guard_memory(VirtualMachine *machine){
+    pthread_once(&installed, install);
+    if(machine->guarded)
+        return true;
+    // Mapped without a guard, like a spawned machine on a host which
+    // can not cover the reach of the operands
+    if(machine->mapping != NULL)
+        return false;
+    size_t page = pageSize();
+    size_t rounded = ((size_t)machine->memSize + page - 1) / page * page;
+    size_t size = rounded + GUARD_SIZE;
+    uint8_t *mapping = (uint8_t *)mmap(NULL, size, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(mapping == MAP_FAILED)
+        return false;
+    if(rounded > 0 && mprotect(mapping, rounded, PROT_READ | PROT_WRITE) != 0){
+        munmap(mapping, size);
+        return false;
+    }
+
+    uint8_t *memory = mapping + rounded - machine->memSize;
+    memcpy(memory, machine->memory, machine->memSize);
+    free(machine->memory);
+    machine->memory = memory;
+    machine->mapping = mapping;
+    machine->mappingSize = size;
+    machine->guarded = true;
+    return true;
+}
+
+Guard* guard_enter(VirtualMachine *machine){
+    guard.machine = machine;
+    armed = machine->guarded;
+    return &guard;
+}
+
+void guard_leave(){
+    armed = false;
+}
+
+#else
+
+// Not enough address space to cover the reach of the operands,
+// the memory stays as it is
+
+size_t guard_size(){
+    return 0;
+}
+
+bool guard_memory(VirtualMachine *machine){
+    (void)machine;
+    return true;
+}
+
+static Guard guard;
+
+Guard* guard_enter(VirtualMachine *machine){
+    guard.machine = machine;
+    return &guard;
+}
+
+void guard_leave(){
+}
+
+#endif
+
+#endif
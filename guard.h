@@ -0,0 +1,31 @@
+#pragma once
+#include "rm_common.h"
+#include "vm.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef GUARD_MEMORY
+
+#include <setjmp.h>
+
+// Where a fault on the guard pages of the running machine lands
+typedef struct{
+    VirtualMachine *machine;
+    sigjmp_buf env;
+    bool write; // whether the faulting access was a write
+} Guard;
+
+// Moves the memory of the machine into a mapping which is followed
+// by guard pages, if it is not already in one
+bool guard_memory(VirtualMachine *machine);
+// Bytes of address space the guard takes after the memory, zero
+// if the host can not have one
+size_t guard_size();
+// Catches faults on the guard pages of machine in this thread,
+// until guard_leave. The caller has to sigsetjmp on the env of
+// the returned guard.
+Guard* guard_enter(VirtualMachine *machine);
+void guard_leave();
+
+#endif
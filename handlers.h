@@ -0,0 +1,433 @@
+/* Handlers of the interpreter
+ * ===========================
+ *
+ * One CASE for each value of Handler, in any order. execute.h
+ * includes them inside execute, as the labels of computed gotos
+ * or the cases of a switch, or outside it, where each CASE is a
+ * function of its own, see Dispatch by tail calls in vm.c.
+ *
+ * A handler ends with DISPATCH, CONTINUE, RESUME or a return,
+ * and keeps the state of the machine, other than the registers,
+ * the record it runs and the count of instructions, in STATE.
+ */
+
+CASE(decode):
+    // Native code is neither checked nor traced
+    if(!CHECKED && !TRACED && machine->jit != NULL && profile == NULL && machine->sampler == NULL){
+        int32_t block = jit_compile(machine, PC_OFFSET);
+        if(block >= 0){
+            INS.handler = handlers[H_native];
+            INS.length = 1;
+            INS.a = block;
+            machine->codeMap[PC_OFFSET] |= 1;
+            EXECUTE();
+        }
+    }
+    decode(machine, PC_OFFSET, handlers);
+    EXECUTE();
+CASE(native):
+    // Blocks keep the registers in the machine
+    SAVE_STATE();
+    machine->PC = jit_execute(machine, INS.a);
+    LOAD_STATE();
+    if(retired >= limit){
+        output_flush(output);
+        return RM_BUDGET;
+    }
+    DISPATCH();
+CASE(backedge):{
+    // The constant of a jump which has one is read from
+    // the memory, b holds the count here
+    Code opcode = (Code)memory[PC_OFFSET];
+    Instruction jump = INS;
+    if(opcode >= OP_jeqi && opcode <= OP_jlti)
+        jump.b = bc_read_long(&memory[PC_OFFSET + 2]);
+    bool jumps = opcode == OP_jmp || taken(opcode, registers, &jump);
+    // loop counts down whether it jumps or not
+    if(opcode == OP_loop)
+        regl(INS.r1) = (uint32_t)regl(INS.r1) - 1;
+    if(jumps){
+        // b counts the trips in its low half, and the traces
+        // compiled for them in its high half. A loop which
+        // keeps coming back here leaves its trace too often,
+        // and is traced again, along the path it takes now.
+        uint32_t target = INS.a;
+        if((++INS.b & 0xffff) == JIT_HOT_LOOP && (INS.b >> 16) < JIT_MAX_TRACES){
+            int32_t block = jit_trace(machine, target, registers);
+            if(block >= 0){
+                code[target] = (Instruction){handlers[H_native], 1, 0, 0, 0, block, 0};
+                machine->codeMap[target] |= 1;
+            }
+            INS.b = (block >= 0 ? (INS.b >> 16) + 1 : JIT_MAX_TRACES) << 16;
+        }
+        JUMP(target);
+        DISPATCH();
+    }
+    // Only the conditional jumps fall through
+    INCR_PC(INS.length);
+    DISPATCH();
+}
+CASE(add):
+    ARITHMETIC(+, FLAGS_ADD);
+CASE(sub):
+    ARITHMETIC(-, FLAGS_SUB);
+CASE(mul):
+    ARITHMETIC(*, FLAGS_MUL);
+CASE(div):
+    BINARY(/);
+CASE(and):
+    BINARY(&);
+CASE(or):
+    BINARY(|);
+CASE(not):
+    regl(INS.r1) = ~regl(INS.r1);
+    INCR_PC(2);
+    DISPATCH();
+CASE(lshift):
+    SHIFT(<<);
+CASE(rshift):
+    SHIFT(>>);
+CASE(load):
+    regl(INS.r1) = READ_LONG(INS.a);
+    INCR_PC(6);
+    DISPATCH();
+CASE(store):
+    EXEC_store();
+    INCR_PC(6);
+    DISPATCH();
+CASE(mov):
+    regl(INS.r1) = INS.a;
+    INCR_PC(6);
+    DISPATCH();
+CASE(save):
+    WRITE_LONG(INS.b, INS.a);
+    INCR_PC(9);
+    DISPATCH();
+CASE(print):
+    output_int(output, (int32_t)READ_LONG(INS.a));
+    INCR_PC(5);
+    DISPATCH();
+CASE(printc):
+    output_char(output, READ_BYTE(INS.a));
+    INCR_PC(5);
+    DISPATCH();
+CASE(jeq):
+    BICONDITIONAL(==);
+CASE(jne):
+    BICONDITIONAL(!=);
+CASE(jgt):
+    BICONDITIONAL(>);
+CASE(jlt):
+    BICONDITIONAL(<);
+CASE(jov):
+    STATUS_JUMP(1);
+CASE(jun):
+    STATUS_JUMP(2);
+CASE(clrpc):
+    JUMP(0);
+    DISPATCH();
+CASE(clrsr):
+    STATE(flagOp) = FLAGS_SETTLED;
+    machine->SR = 0;
+    INCR_PC(1);
+    DISPATCH();
+CASE(halt):
+    STOP();
+    return RM_HALTED;
+CASE(const):
+    // this should never be the case, the decoder
+    // never emits them
+    RESUME(nex);
+CASE(str):
+    RESUME(nex);
+CASE(space):
+    RESUME(nex);
+CASE(nex):
+    STOP();
+    err("Trying to execute non-executable code at offset "
+            ANSI_FONT_BOLD ANSI_COLOR_RED "%04" PRIu32 ANSI_COLOR_RESET "!\n", PC_OFFSET);
+    return RM_FAULT;
+CASE(fault):
+    STOP();
+    err("Trying to %s unmapped memory at offset " ANSI_COLOR_RED ANSI_FONT_BOLD
+            "%04" PRIu32 ANSI_COLOR_RESET "!\n", INS.r1 ? "write to" : "read from", INS.a);
+    return RM_FAULT;
+CASE(mcopy):{
+    uint32_t val = READ_LONG(INS.a);
+    WRITE_LONG(INS.b, val);
+    INCR_PC(9);
+    DISPATCH();
+}
+CASE(rcopy):
+    EXEC_rcopy();
+    INCR_PC(3);
+    DISPATCH();
+CASE(jmp):
+    JUMP(INS.a);
+    DISPATCH();
+CASE(incr):
+    EXEC_incr();
+    INCR_PC(2);
+    DISPATCH();
+CASE(decr):
+    EXEC_decr();
+    INCR_PC(2);
+    DISPATCH();
+CASE(prints):{
+    if(CHECKED){
+        uint32_t offset = INS.a;
+        uint32_t i = 0, len = INS.b;
+        while(i < len){
+            output_char(output, READ_BYTE(offset + i));
+            i++;
+        }
+    }
+    else
+        output_bytes(output, (const char *)&memory[INS.a], INS.b);
+    INCR_PC(9);
+    DISPATCH();
+}
+CASE(bcopy):{
+    uint32_t bytes = regl(INS.r1);
+    BLOCK_RANGE(INS.a, bytes, false);
+    BLOCK_RANGE(INS.b, bytes, true);
+    memmove(&memory[INS.b], &memory[INS.a], bytes);
+    blockWritten(machine, INS.b, bytes);
+    INCR_PC(10);
+    DISPATCH();
+}
+CASE(bfill):{
+    uint32_t bytes = regl(INS.r2);
+    BLOCK_RANGE(INS.a, bytes, true);
+    memset(&memory[INS.a], (uint8_t)regl(INS.r1), bytes);
+    blockWritten(machine, INS.a, bytes);
+    INCR_PC(7);
+    DISPATCH();
+}
+CASE(bcmp):{
+    uint32_t bytes = regl(INS.r1);
+    BLOCK_RANGE(INS.a, bytes, false);
+    BLOCK_RANGE(INS.b, bytes, false);
+    int order = memcmp(&memory[INS.a], &memory[INS.b], bytes);
+    regl(INS.r2) = order < 0 ? -1 : order > 0;
+    INCR_PC(11);
+    DISPATCH();
+}
+CASE(vadd):
+    VECTOR(VECTOR_ADD);
+CASE(vsub):
+    VECTOR(VECTOR_SUB);
+CASE(vmul):
+    VECTOR(VECTOR_MUL);
+CASE(vand):
+    VECTOR(VECTOR_AND);
+CASE(vor):
+    VECTOR(VECTOR_OR);
+CASE(vsum):
+    REDUCTION(VECTOR_SUM);
+CASE(vmin):
+    REDUCTION(VECTOR_MIN);
+CASE(vmax):
+    REDUCTION(VECTOR_MAX);
+CASE(addb):
+    NARROW_ARITHMETIC(+, int8_t, 8);
+CASE(addw):
+    NARROW_ARITHMETIC(+, int16_t, 16);
+CASE(subb):
+    NARROW_ARITHMETIC(-, int8_t, 8);
+CASE(subw):
+    NARROW_ARITHMETIC(-, int16_t, 16);
+CASE(andb):
+    NARROW_BINARY(&, 8);
+CASE(andw):
+    NARROW_BINARY(&, 16);
+CASE(orb):
+    NARROW_BINARY(|, 8);
+CASE(orw):
+    NARROW_BINARY(|, 16);
+CASE(movb):
+    SET_LANE(INS.r1, INS.b, 8, INS.a);
+    INCR_PC(3);
+    DISPATCH();
+CASE(movw):
+    SET_LANE(INS.r1, INS.b, 16, INS.a);
+    INCR_PC(4);
+    DISPATCH();
+CASE(loadb):
+    SET_LANE(INS.r1, INS.b, 8, READ_BYTE(INS.a));
+    INCR_PC(6);
+    DISPATCH();
+CASE(loadw):
+    SET_LANE(INS.r1, INS.b, 16, READ_WORD(INS.a));
+    INCR_PC(6);
+    DISPATCH();
+CASE(storeb):
+    WRITE_BYTE(INS.a, LANE(INS.r1, INS.b, 8));
+    blockWritten(machine, INS.a, 1);
+    INCR_PC(6);
+    DISPATCH();
+CASE(storew):{
+    uint32_t val = LANE(INS.r1, INS.b, 16);
+    WRITE_WORD(INS.a, val);
+    blockWritten(machine, INS.a, 2);
+    INCR_PC(6);
+    DISPATCH();
+}
+CASE(loadr):{
+    uint32_t address = BASED();
+    BLOCK_RANGE(address, 4, false);
+    regl(INS.r2) = READ_LONG(address);
+    INCR_PC(7);
+    DISPATCH();
+}
+CASE(loadx):{
+    uint32_t address = INDEXED();
+    BLOCK_RANGE(address, 4, false);
+    regl(INS.r3) = READ_LONG(address);
+    INCR_PC(8);
+    DISPATCH();
+}
+CASE(storer):{
+    uint32_t address = BASED();
+    BLOCK_RANGE(address, 4, true);
+    WRITE_LONG(address, regl(INS.r2));
+    INCR_PC(7);
+    DISPATCH();
+}
+CASE(storex):{
+    uint32_t address = INDEXED();
+    BLOCK_RANGE(address, 4, true);
+    WRITE_LONG(address, regl(INS.r3));
+    INCR_PC(8);
+    DISPATCH();
+}
+CASE(printr):{
+    uint32_t address = BASED();
+    BLOCK_RANGE(address, 4, false);
+    output_int(output, (int32_t)READ_LONG(address));
+    INCR_PC(6);
+    DISPATCH();
+}
+CASE(printx):{
+    uint32_t address = INDEXED();
+    BLOCK_RANGE(address, 4, false);
+    output_int(output, (int32_t)READ_LONG(address));
+    INCR_PC(7);
+    DISPATCH();
+}
+CASE(addi):
+    ARITHMETIC_IMMEDIATE(+, FLAGS_ADD);
+CASE(subi):
+    ARITHMETIC_IMMEDIATE(-, FLAGS_SUB);
+CASE(muli):
+    ARITHMETIC_IMMEDIATE(*, FLAGS_MUL);
+CASE(divi):
+    BINARY_IMMEDIATE(/);
+CASE(andi):
+    BINARY_IMMEDIATE(&);
+CASE(ori):
+    BINARY_IMMEDIATE(|);
+CASE(jeqi):
+    CONDITIONAL_IMMEDIATE(==);
+CASE(jnei):
+    CONDITIONAL_IMMEDIATE(!=);
+CASE(jgti):
+    CONDITIONAL_IMMEDIATE(>);
+CASE(jlti):
+    CONDITIONAL_IMMEDIATE(<);
+CASE(lshiftr):
+    SHIFT_REGISTER(<<);
+CASE(rshiftr):
+    SHIFT_REGISTER(>>);
+CASE(call):
+    PUSH(PC_OFFSET + 5);
+    // The oldest record is overwritten once there are too
+    // many, and its ret reads the stack instead
+    STATE(returns)[STATE(returnTop)].sp = STATE(sp);
+    STATE(returns)[STATE(returnTop)].ip = ip + 5;
+    STATE(returnTop) = (STATE(returnTop) + 1) % RETURN_DEPTH;
+    STATE(returnCount) += STATE(returnCount) < RETURN_DEPTH;
+    JUMP(INS.a);
+    DISPATCH();
+CASE(ret):
+    if(STATE(sp) == machine->stackSize){
+        STACK_FAULT("underflow");
+    }
+    // Only call and push write the stack, and the long a call
+    // pushed can only be overwritten once it is popped, which
+    // drops its record. So while the record is on top, ret
+    // goes back to it without reading the stack, or looking
+    // up the record of the offset again.
+    if(RETURN_HIT){
+        Instruction *back = STATE(returns)[RETURN_TOP].ip;
+        RETURN_DROP();
+        STATE(sp)++;
+        JUMP_RECORD(back);
+        DISPATCH();
+    }
+    else{
+        // Returns past the memory land on the sentinel
+        uint32_t back = stack[STATE(sp)++];
+        JUMP(back > machine->memSize ? machine->memSize : back);
+        DISPATCH();
+    }
+CASE(loop):
+    regl(INS.r1) = (uint32_t)regl(INS.r1) - 1;
+    if(regl(INS.r1) != 0){
+        JUMP(INS.a);
+        DISPATCH();
+    }
+    INCR_PC(6);
+    DISPATCH();
+CASE(djnz):
+    SET_LANE(INS.r1, INS.b, 8, LANE(INS.r1, INS.b, 8) - 1);
+    if(LANE(INS.r1, INS.b, 8) != 0){
+        JUMP(INS.a);
+        DISPATCH();
+    }
+    INCR_PC(6);
+    DISPATCH();
+CASE(push):
+    PUSH(regl(INS.r1));
+    INCR_PC(2);
+    DISPATCH();
+CASE(pop):
+    if(STATE(sp) == machine->stackSize){
+        STACK_FAULT("underflow");
+    }
+    if(RETURN_HIT){
+        RETURN_DROP();
+    }
+    regl(INS.r1) = stack[STATE(sp)++];
+    INCR_PC(2);
+    DISPATCH();
+#define OPCODE(name, a, b)
+// A store which writes to the pair drops its record, and the one
+// of the second, which is then decoded again before it runs
+#define SUPERINSTRUCTION(first, second) \
+CASE(first##_##second): \
+    EXEC_##first(); \
+    if(OP_##first == OP_store && INS.handler == 0){ \
+        INCR_PC(LENGTH_##first); \
+        DISPATCH(); \
+    } \
+    INCR_PC(LENGTH_##first); \
+    CONTINUE(second);
+#include "opcodes.h"
+#undef SUPERINSTRUCTION
+#undef OPCODE
+#define OPCODE(name, a, b) \
+CASE(profile_##name): \
+    profile->opcodes[OP_##name]++; \
+    profile->offsets[PC_OFFSET]++; \
+    profile->taken[PC_OFFSET] += taken(OP_##name, registers, ip); \
+    RESUME(name);
+#include "opcodes.h"
+#undef OPCODE
+// The timer reads the PC from the machine, at any time
+#define OPCODE(name, a, b) \
+CASE(sample_##name): \
+    __atomic_store_n(&machine->PC, PC_OFFSET, __ATOMIC_RELAXED); \
+    RESUME(name);
+#include "opcodes.h"
+#undef OPCODE
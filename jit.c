@@ -0,0 +1,1196 @@
+#include "jit.h"
+#include "bytecode.h"
+#include "display.h"
+#include "snapshot.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+/* Baseline JIT
+ * ============
+ *
+ * Compiles runs of bytecode into x86-64 code. A block starts
+ * where the dispatcher first reaches an undecoded record, and
+ * runs until an instruction which is not supported here. It
+ * follows unconditional jumps, and jumps to an instruction which
+ * is already in the block stay native, so loops run without
+ * leaving it. These back edges charge the budget of rm_run_for,
+ * and leave the block once it runs out. Other taken jumps leave
+ * the block and return the next PC to the interpreter. The guest
+ * registers live in host registers while a block runs, and are
+ * written back to the VirtualMachine when it leaves, or calls
+ * back into C.
+ *
+ * Arithmetic copies its operands to FLAG_A and FLAG_B for the
+ * status flags, and the compiler tracks which operation they
+ * belong to. incr and decr leave the copy until their register
+ * is overwritten, the operand follows from the result until then.
+ * The operands reach the machine only at the exits and calls,
+ * instead of at each instruction. A jump back to an instruction
+ * which expects another operation there leaves the block
+ * instead, unless no exit can see the difference. Loop heads
+ * start on a 32 byte boundary.
+ *
+ * With tracing on, blocks are compiled only for hot loops instead,
+ * see Traces below.
+ *
+ * Bytes which a program writes over after they were compiled are
+ * marked as modified, and are left to the interpreter from then
+ * on.
+ */
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <sys/mman.h>
+
+// Size of the executable arena of each machine
+#define ARENA_SIZE (4 * 1024 * 1024)
+// Maximum number of instructions in a block
+#define MAX_BLOCK_LENGTH 256
+// Leaves room for the exits and slow paths of the longest block
+#define MAX_BLOCK_CODE (MAX_BLOCK_LENGTH * 400 + 256)
+
+typedef uint32_t (*NativeBlock)(VirtualMachine *machine);
+
+typedef struct{
+    uint32_t start; // offset of the entry
+    uint32_t low, high; // bytecode range compiled into the block
+    uint8_t *entry;
+    bool live;
+} Block;
+
+struct Jit{
+    uint8_t *arena;
+    uint32_t used;
+    Block *blocks;
+    uint32_t blockCount;
+    uint8_t *modified; // bytes written after being compiled
+    uint8_t *scratch; // a block is assembled here before it is installed
+    bool tracing; // only hot loops are compiled, as traces
+};
+
+// Host registers
+enum{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// Host registers holding r0 to r7 while a block runs. r8 holds
+// the memory base, r9 the machine, rsi the budget, and rdx and
+// rdi the operands of the last arithmetic, the rest are scratch.
+static const uint8_t guestRegister[8] = {RBX, RBP, R12, R13, R14, R15, R10, R11};
+
+#define MEMORY_BASE R8
+#define MACHINE R9
+#define FUEL RSI
+#define FLAG_A RDX
+#define FLAG_B RDI
+// A pending incr or decr of guest register r, whose operand is
+// not copied to FLAG_A yet
+#define FLAGS_DEFERRED(op, r) ((op) | (((r) + 1) << 3))
+
+// Condition codes of jcc
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_L  0xc
+#define CC_G  0xf
+#define CC_A  0x7
+
+// Condition codes of jeq, jne, jgt and jlt, and of their
+// immediate forms
+static const uint8_t conditions[] = {CC_E, CC_NE, CC_G, CC_L};
+
+/* Code buffer
+ * ===========
+ */
+
+typedef struct{
+    uint8_t *code;
+    uint32_t size;
+} Buffer;
+
+static void emit(Buffer *b, uint8_t byte){
+    b->code[b->size++] = byte;
+}
+
+static void emit32(Buffer *b, uint32_t val){
+    memcpy(&b->code[b->size], &val, 4);
+    b->size += 4;
+}
+
+static void emit64(Buffer *b, uint64_t val){
+    memcpy(&b->code[b->size], &val, 8);
+    b->size += 8;
+}
+
+// Patches a rel32 at 'at' to point to 'target'
+static void patch(Buffer *b, uint32_t at, uint32_t target){
+    int32_t rel = (int32_t)target - (int32_t)(at + 4);
+    memcpy(&b->code[at], &rel, 4);
+}
+
+static void emitRex(Buffer *b, bool wide, uint8_t reg, uint8_t rm){
+    uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+    if(rex != 0x40)
+        emit(b, rex);
+}
+
+// <opcode> rm, reg, for register operands
+static void emitRR(Buffer *b, bool wide, uint8_t opcode, uint8_t rm, uint8_t reg){
+    emitRex(b, wide, reg, rm);
+    emit(b, opcode);
+    emit(b, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// <opcode> [base + disp], reg, base must not be rsp or r12
+static void emitRM(Buffer *b, bool wide, uint8_t opcode, uint8_t reg, uint8_t base, uint32_t disp){
+    emitRex(b, wide, reg, base);
+    emit(b, opcode);
+    emit(b, 0x80 | ((reg & 7) << 3) | (base & 7));
+    emit32(b, disp);
+}
+
+// mov reg32, imm32
+static void emitMovImm(Buffer *b, uint8_t reg, uint32_t val){
+    emitRex(b, false, 0, reg);
+    emit(b, 0xb8 + (reg & 7));
+    emit32(b, val);
+}
+
+// <group opcode> /ext reg32, imm8
+static void emitGroupImm8(Buffer *b, uint8_t opcode, uint8_t ext, uint8_t reg, uint8_t val){
+    emitRex(b, false, 0, reg);
+    emit(b, opcode);
+    emit(b, 0xc0 | (ext << 3) | (reg & 7));
+    emit(b, val);
+}
+
+// <0x81 group> /ext reg32, imm32
+static void emitGroupImm32(Buffer *b, uint8_t ext, uint8_t reg, uint32_t val){
+    emitRex(b, false, 0, reg);
+    emit(b, 0x81);
+    emit(b, 0xc0 | (ext << 3) | (reg & 7));
+    emit32(b, val);
+}
+
+static void emitPush(Buffer *b, uint8_t reg){
+    emitRex(b, false, 0, reg);
+    emit(b, 0x50 + (reg & 7));
+}
+
+static void emitPop(Buffer *b, uint8_t reg){
+    emitRex(b, false, 0, reg);
+    emit(b, 0x58 + (reg & 7));
+}
+
+// jcc rel32, returns the offset of the rel32 to patch
+static uint32_t emitJcc(Buffer *b, uint8_t cc){
+    emit(b, 0x0f);
+    emit(b, 0x80 | cc);
+    emit32(b, 0);
+    return b->size - 4;
+}
+
+// jmp rel32, returns the offset of the rel32 to patch
+static uint32_t emitJmp(Buffer *b){
+    emit(b, 0xe9);
+    emit32(b, 0);
+    return b->size - 4;
+}
+
+// Pads with nops up to a 32 byte boundary. A loop which starts on
+// one fits in the fewest lines of the decoded instruction cache,
+// and its jumps do not straddle them, which costs as much as the
+// loop itself on many Intel cores.
+static void emitAlign(Buffer *b){
+    static const uint8_t nops[][8] = {
+        {0x90},
+        {0x66, 0x90},
+        {0x0f, 0x1f, 0x00},
+        {0x0f, 0x1f, 0x40, 0x00},
+        {0x0f, 0x1f, 0x44, 0x00, 0x00},
+        {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00},
+        {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00},
+        {0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00}
+    };
+    uint32_t pad = (32 - (b->size & 31)) & 31;
+    while(pad > 0){
+        uint32_t n = pad > 8 ? 8 : pad;
+        memcpy(&b->code[b->size], nops[n - 1], n);
+        b->size += n;
+        pad -= n;
+    }
+}
+
+#define REGISTER_OFFSET(i) (uint32_t)(offsetof(VirtualMachine, registers) + 4 * (i))
+
+// The budget left to the block is kept in FUEL, as limit - retired
+static void emitSpill(Buffer *b){
+    for(uint8_t i = 0;i < 8;i++)
+        emitRM(b, false, 0x89, guestRegister[i], MACHINE, REGISTER_OFFSET(i));
+    emitRM(b, true, 0x8b, RCX, MACHINE, offsetof(VirtualMachine, limit));
+    emitRR(b, true, 0x29, RCX, FUEL);
+    emitRM(b, true, 0x89, RCX, MACHINE, offsetof(VirtualMachine, retired));
+}
+
+static void emitReload(Buffer *b){
+    for(uint8_t i = 0;i < 8;i++)
+        emitRM(b, false, 0x8b, guestRegister[i], MACHINE, REGISTER_OFFSET(i));
+    emitRM(b, true, 0x8b, FUEL, MACHINE, offsetof(VirtualMachine, limit));
+    emitRM(b, true, 0x2b, FUEL, MACHINE, offsetof(VirtualMachine, retired));
+}
+
+// Calls helper(machine, arg1, arg2). The guest registers are
+// written back before, and read again after the call.
+static void emitCall(Buffer *b, void *helper, uint32_t arg1, uint32_t arg2){
+    emitSpill(b);
+    emitRR(b, true, 0x89, RDI, MACHINE);
+    emitMovImm(b, RSI, arg1);
+    emitMovImm(b, RDX, arg2);
+    emit(b, 0x48);
+    emit(b, 0xb8);
+    emit64(b, (uint64_t)(uintptr_t)helper);
+    emit(b, 0xff);
+    emit(b, 0xd0);
+    // mov r9, [rsp]
+    emit(b, 0x4c);
+    emit(b, 0x8b);
+    emit(b, 0x0c);
+    emit(b, 0x24);
+    emitRM(b, true, 0x8b, MEMORY_BASE, MACHINE, offsetof(VirtualMachine, memory));
+    emitReload(b);
+}
+
+// mov byte [machine + disp], val
+static void emitStoreByte(Buffer *b, uint32_t disp, uint8_t val){
+    emitRex(b, false, 0, MACHINE);
+    emit(b, 0xc6);
+    emit(b, 0x80 | (MACHINE & 7));
+    emit32(b, disp);
+    emit(b, val);
+}
+
+// Copies the operand of a deferred incr or decr to FLAG_A, from
+// its result. Returns the operation pending after it.
+static uint8_t emitFlagOperand(Buffer *b, uint8_t pending){
+    if((pending >> 3) == 0)
+        return pending;
+    uint8_t op = pending & 7;
+    emitRR(b, false, 0x89, FLAG_A, guestRegister[(pending >> 3) - 1]);
+    // sub or add 1
+    emitGroupImm8(b, 0x83, op == FLAGS_INCR ? 5 : 0, FLAG_A, 1);
+    return op;
+}
+
+// Writes the operation op, with the operands kept in FLAG_A and
+// FLAG_B, to the status flags of the machine
+static void emitFlagSpill(Buffer *b, uint8_t op){
+    op = emitFlagOperand(b, op);
+    emitStoreByte(b, offsetof(VirtualMachine, flagOp), op);
+    emitRM(b, false, 0x89, FLAG_A, MACHINE, offsetof(VirtualMachine, flagA));
+    if(op != FLAGS_INCR && op != FLAGS_DECR)
+        emitRM(b, false, 0x89, FLAG_B, MACHINE, offsetof(VirtualMachine, flagB));
+}
+
+/* Helpers called from native code
+ * ===============================
+ */
+
+static uint32_t readLong(VirtualMachine *machine, uint32_t offset){
+    return bc_read_long(&machine->memory[offset]);
+}
+
+static void helper_print(VirtualMachine *machine, uint32_t offset, uint32_t unused){
+    (void)unused;
+    output_int(&machine->output, (int32_t)readLong(machine, offset));
+}
+
+static void helper_printc(VirtualMachine *machine, uint32_t offset, uint32_t unused){
+    (void)unused;
+    output_char(&machine->output, machine->memory[offset]);
+}
+
+static void helper_prints(VirtualMachine *machine, uint32_t offset, uint32_t length){
+    output_bytes(&machine->output, (const char *)&machine->memory[offset], length);
+}
+
+static void helper_written(VirtualMachine *machine, uint32_t offset, uint32_t bytes){
+    if(machine->dirty != NULL)
+        rm_dirty(machine, offset, bytes);
+    uint32_t m;
+    memcpy(&m, &machine->codeMap[offset], 4);
+    if(m)
+        rm_invalidate(machine, offset, bytes);
+}
+
+/* Compiler
+ * ========
+ */
+
+typedef struct{
+    uint32_t at; // rel32 to patch
+    uint32_t pc; // PC to return
+    uint32_t store; // offset of the store, for slow paths
+    uint8_t kind;
+    uint8_t flags; // operation pending in FLAG_A and FLAG_B, if any
+} Exit;
+
+enum{
+    EXIT_RETURN, // leave the block and continue at pc
+    EXIT_WRITTEN // a store hit decoded code, or a clean chunk
+};
+
+// Whether an access lies in the memory, and can be encoded as a
+// 32 bit displacement
+static bool fits(VirtualMachine *machine, uint32_t offset, uint32_t bytes){
+    return offset <= machine->memSize && bytes <= machine->memSize - offset
+        && (uint64_t)offset + bytes <= INT32_MAX;
+}
+
+// The operation recorded for the status flags by opcode, if any
+static uint8_t flagsOf(Code opcode){
+    switch(opcode){
+        case OP_add: case OP_addi: return FLAGS_ADD;
+        case OP_sub: case OP_subi: return FLAGS_SUB;
+        case OP_mul: case OP_muli: return FLAGS_MUL;
+        case OP_incr: return FLAGS_INCR;
+        case OP_decr: return FLAGS_DECR;
+        default: return FLAGS_SETTLED;
+    }
+}
+
+// The guest register an instruction writes, -1 if none
+static int8_t destination(const Operation *op){
+    switch(op->opcode){
+        case OP_add:
+        case OP_sub:
+        case OP_mul:
+        case OP_and:
+        case OP_or:
+        case OP_rcopy:
+            return op->reg[1];
+        case OP_not:
+        case OP_lshift:
+        case OP_rshift:
+        case OP_incr:
+        case OP_decr:
+        case OP_mov:
+        case OP_load:
+        case OP_addi:
+        case OP_subi:
+        case OP_muli:
+        case OP_andi:
+        case OP_ori:
+        case OP_lshiftr:
+        case OP_rshiftr:
+        case OP_loop:
+            return op->reg[0];
+        default:
+            return -1;
+    }
+}
+
+// What an instruction does to the status flags
+enum{
+    EFFECT_NONE,
+    EFFECT_SETS, // overwrites them
+    EFFECT_READS // leaves the block, or calls back into C
+};
+
+// Whether the flags pending when the instruction at index from is
+// entered can reach an exit or a call, before they are overwritten
+static bool flagsExposed(const uint8_t *effects, uint32_t from, uint32_t count){
+    for(uint32_t i = from;i < count;i++){
+        if(effects[i] == EFFECT_SETS)
+            return false;
+        if(effects[i] == EFFECT_READS)
+            return true;
+    }
+    // Reaches the instruction being compiled
+    return true;
+}
+
+// Whether a jump from where the flags pending are pending, to the
+// instruction at index target, can stay in the block. When the
+// flags there are in the machine, they are written back first.
+static bool flagsMerge(Buffer *b, const uint8_t *flagsAt, const uint8_t *effects, uint32_t target, uint32_t count, uint8_t pending){
+    if(pending == flagsAt[target] || !flagsExposed(effects, target, count))
+        return true;
+    if(flagsAt[target] != FLAGS_SETTLED)
+        return false;
+    emitFlagSpill(b, pending);
+    return true;
+}
+
+static bool isModified(struct Jit *jit, uint32_t offset, uint32_t length){
+    for(uint32_t i = 0;i < length;i++)
+        if(jit->modified[offset + i])
+            return true;
+    return false;
+}
+
+// Emits the check done after each store, which leaves the block
+// through a slow path when the store hit decoded code, or a chunk
+// a spawned machine has not written yet
+static void emitWriteCheck(VirtualMachine *machine, Buffer *b, Exit *exits, uint32_t *exitCount, uint32_t address, uint32_t next){
+    emitRM(b, true, 0x8b, RCX, MACHINE, offsetof(VirtualMachine, codeMap));
+    emitRM(b, false, 0x8b, RCX, RCX, address);
+    emitRR(b, false, 0x85, RCX, RCX);
+    exits[*exitCount] = (Exit){emitJcc(b, CC_NE), next, address, EXIT_WRITTEN, 0};
+    (*exitCount)++;
+    if(machine->dirty == NULL)
+        return;
+    emitRM(b, true, 0x8b, RCX, MACHINE, offsetof(VirtualMachine, dirty));
+    uint32_t first = address >> DIRTY_SHIFT, last = (address + 3) >> DIRTY_SHIFT;
+    for(uint32_t chunk = first;chunk <= last;chunk++){
+        emitRM(b, false, 0x80, 7, RCX, chunk);
+        emit(b, 0); // cmp byte [rcx + chunk], 0
+        exits[*exitCount] = (Exit){emitJcc(b, CC_E), next, address, EXIT_WRITTEN, 0};
+        (*exitCount)++;
+    }
+}
+
+// Emits a jump back into the block, to the instruction at target,
+// which is compiled at position. Each trip charges the budget with
+// the instructions it runs, and leaves the block once it is spent.
+static void emitBackEdge(Buffer *b, Exit *exits, uint32_t *exitCount, uint32_t target, uint32_t position, uint32_t charge){
+    emitRex(b, true, 0, FUEL);
+    emit(b, 0x81);
+    emit(b, 0xe8 | (FUEL & 7));
+    emit32(b, charge); // sub rsi, imm32
+    patch(b, emitJcc(b, CC_A), position);
+    exits[*exitCount] = (Exit){emitJmp(b), target, 0, EXIT_RETURN, 0};
+    (*exitCount)++;
+}
+
+// Emits the comparison of a conditional jump, and returns the
+// condition on which it jumps
+static uint8_t emitCompare(Buffer *b, const Operation *op){
+    // dec and jnz, written as sub for the flags it sets
+    if(op->opcode == OP_loop){
+        emitGroupImm8(b, 0x83, 5, guestRegister[op->reg[0]], 1);
+        return CC_NE;
+    }
+    if(op->opcode >= OP_jeqi && op->opcode <= OP_jlti){
+        emitGroupImm32(b, 7, guestRegister[op->reg[0]], op->val[1]);
+        return conditions[op->opcode - OP_jeqi];
+    }
+    emitRR(b, false, 0x39, guestRegister[op->reg[0]], guestRegister[op->reg[1]]);
+    return conditions[op->opcode - OP_jeq];
+}
+
+// Collects the offsets which the jumps on the path of a block from
+// offset lead back to, the heads of its loops
+static uint32_t loopHeads(VirtualMachine *machine, uint32_t offset, uint32_t *heads){
+    uint32_t starts[MAX_BLOCK_LENGTH];
+    uint32_t count = 0, headCount = 0, pc = offset;
+    while(count < MAX_BLOCK_LENGTH){
+        Operation op;
+        if(!bc_decode_op(machine->memory, pc, machine->memSize, &op) || isModified(machine->jit, pc, op.length)
+                || op.opcode == OP_halt)
+            break;
+        starts[count++] = pc;
+        uint32_t next = pc + op.length;
+        if(op.opcode == OP_jmp || bc_is_conditional(op.opcode)){
+            for(uint32_t i = 0;i < count;i++){
+                if(starts[i] == op.val[0]){
+                    heads[headCount++] = op.val[0];
+                    if(op.opcode == OP_jmp)
+                        return headCount;
+                    break;
+                }
+            }
+            if(op.opcode == OP_jmp)
+                next = op.val[0];
+        }
+        pc = next;
+    }
+    return headCount;
+}
+
+// Saved by the prologue, rdi keeps the stack aligned for calls
+static const uint8_t saved[] = {RBX, RBP, R12, R13, R14, R15, RDI};
+
+static void emitPrologue(Buffer *b){
+    for(uint8_t i = 0;i < sizeof(saved);i++)
+        emitPush(b, saved[i]);
+    emitRR(b, true, 0x89, MACHINE, RDI);
+    emitRM(b, true, 0x8b, MEMORY_BASE, MACHINE, offsetof(VirtualMachine, memory));
+    emitReload(b);
+}
+
+// Emits an instruction other than a jump, which goes on to next.
+// Keeps track of the operation pending for the status flags, and
+// sets effect to what the instruction does to them. Returns false
+// if the instruction is left to the interpreter.
+static bool emitOperation(VirtualMachine *machine, Buffer *b, const Operation *op, uint32_t next,
+        Exit *exits, uint32_t *exitCount, uint8_t *pending, uint8_t *effect){
+    uint8_t x = guestRegister[op->reg[0]], y = guestRegister[op->reg[1]];
+    *effect = EFFECT_NONE;
+
+    // Arithmetic keeps its operands for the status flags
+    uint8_t flags = flagsOf(op->opcode);
+    if(flags == FLAGS_INCR || flags == FLAGS_DECR)
+        *pending = FLAGS_DEFERRED(flags, op->reg[0]);
+    else if(flags != FLAGS_SETTLED){
+        emitRR(b, false, 0x89, FLAG_A, x);
+        if(op->opcode >= OP_addi && op->opcode <= OP_muli)
+            emitMovImm(b, FLAG_B, op->val[0]);
+        else
+            emitRR(b, false, 0x89, FLAG_B, y);
+        *pending = flags;
+    }
+    else if((*pending >> 3) != 0 && destination(op) == (*pending >> 3) - 1)
+        *pending = emitFlagOperand(b, *pending);
+    if(flags != FLAGS_SETTLED)
+        *effect = EFFECT_SETS;
+
+    switch(op->opcode){
+        case OP_add:
+            emitRR(b, false, 0x01, y, x);
+            return true;
+        case OP_sub:
+            emitRR(b, false, 0x89, RAX, x);
+            emitRR(b, false, 0x29, RAX, y);
+            emitRR(b, false, 0x89, y, RAX);
+            return true;
+        case OP_mul:
+            // imul y, x
+            emitRex(b, false, y, x);
+            emit(b, 0x0f);
+            emit(b, 0xaf);
+            emit(b, 0xc0 | ((y & 7) << 3) | (x & 7));
+            return true;
+        case OP_and:
+            emitRR(b, false, 0x21, y, x);
+            return true;
+        case OP_or:
+            emitRR(b, false, 0x09, y, x);
+            return true;
+        case OP_not:
+            emitRex(b, false, 0, x);
+            emit(b, 0xf7);
+            emit(b, 0xd0 | (x & 7));
+            return true;
+        case OP_lshift:
+            // the host masks the count just like the interpreter
+            emitGroupImm8(b, 0xc1, 4, x, op->val[0] & 31);
+            return true;
+        case OP_rshift:
+            emitGroupImm8(b, 0xc1, 7, x, op->val[0] & 31);
+            return true;
+        case OP_incr:
+            emitGroupImm8(b, 0x83, 0, x, 1);
+            return true;
+        case OP_decr:
+            emitGroupImm8(b, 0x83, 5, x, 1);
+            return true;
+        case OP_mov:
+            emitMovImm(b, x, op->val[0]);
+            return true;
+        case OP_rcopy:
+            emitRR(b, false, 0x89, y, x);
+            return true;
+        case OP_load:
+            if(!fits(machine, op->val[0], 4))
+                return false;
+            emitRM(b, false, 0x8b, RAX, MEMORY_BASE, op->val[0]);
+            emit(b, 0x0f);
+            emit(b, 0xc8); // bswap eax
+            emitRR(b, false, 0x89, x, RAX);
+            return true;
+        case OP_store:
+            if(!fits(machine, op->val[0], 4))
+                return false;
+            emitRR(b, false, 0x89, RAX, x);
+            emit(b, 0x0f);
+            emit(b, 0xc8);
+            emitRM(b, false, 0x89, RAX, MEMORY_BASE, op->val[0]);
+            emitWriteCheck(machine, b, exits, exitCount, op->val[0], next);
+            return true;
+        case OP_save:
+            if(!fits(machine, op->val[1], 4))
+                return false;
+            // mov dword [base + disp], imm32
+            emitRex(b, false, 0, MEMORY_BASE);
+            emit(b, 0xc7);
+            emit(b, 0x80 | (MEMORY_BASE & 7));
+            emit32(b, op->val[1]);
+            emit32(b, __builtin_bswap32(op->val[0]));
+            emitWriteCheck(machine, b, exits, exitCount, op->val[1], next);
+            return true;
+        case OP_mcopy:
+            if(!fits(machine, op->val[0], 4) || !fits(machine, op->val[1], 4))
+                return false;
+            emitRM(b, false, 0x8b, RAX, MEMORY_BASE, op->val[0]);
+            emitRM(b, false, 0x89, RAX, MEMORY_BASE, op->val[1]);
+            emitWriteCheck(machine, b, exits, exitCount, op->val[1], next);
+            return true;
+        case OP_print:
+        case OP_printc:
+        case OP_prints:{
+            uint32_t bytes = op->opcode == OP_print ? 4 : op->opcode == OP_printc ? 1 : op->val[1];
+            if(!fits(machine, op->val[0], bytes))
+                return false;
+            if(*pending != FLAGS_SETTLED)
+                emitFlagSpill(b, *pending);
+            *pending = FLAGS_SETTLED;
+            *effect = EFFECT_READS;
+            if(op->opcode == OP_print)
+                emitCall(b, (void *)helper_print, op->val[0], 0);
+            else if(op->opcode == OP_printc)
+                emitCall(b, (void *)helper_printc, op->val[0], 0);
+            else
+                emitCall(b, (void *)helper_prints, op->val[0], op->val[1]);
+            return true;
+        }
+        case OP_addi:
+            emitGroupImm32(b, 0, x, op->val[0]);
+            return true;
+        case OP_subi:
+            emitGroupImm32(b, 5, x, op->val[0]);
+            return true;
+        case OP_muli:
+            // imul x, x, imm32
+            emitRex(b, false, x, x);
+            emit(b, 0x69);
+            emit(b, 0xc0 | ((x & 7) << 3) | (x & 7));
+            emit32(b, op->val[0]);
+            return true;
+        case OP_andi:
+            emitGroupImm32(b, 4, x, op->val[0]);
+            return true;
+        case OP_ori:
+            emitGroupImm32(b, 1, x, op->val[0]);
+            return true;
+        case OP_lshiftr:
+        case OP_rshiftr:
+            // shl or sar x, cl, which masks the count
+            emitRR(b, false, 0x89, RCX, y);
+            emitRex(b, false, 0, x);
+            emit(b, 0xd3);
+            emit(b, 0xc0 | ((op->opcode == OP_lshiftr ? 4 : 7) << 3) | (x & 7));
+            return true;
+        case OP_clrsr:
+            emitStoreByte(b, offsetof(VirtualMachine, flagOp), FLAGS_SETTLED);
+            emitStoreByte(b, offsetof(VirtualMachine, SR), 0);
+            *pending = FLAGS_SETTLED;
+            *effect = EFFECT_SETS;
+            return true;
+        default:
+            // Left to the interpreter
+            return false;
+    }
+}
+
+// Emits the epilogue and the exits of a block, installs it, and
+// returns its index, or -1 if it could not be installed
+static int32_t install(VirtualMachine *machine, Buffer *b, Exit *exits, uint32_t exitCount,
+        uint32_t start, uint32_t low, uint32_t high){
+    struct Jit *jit = machine->jit;
+
+    // Common epilogue, with the next PC in eax
+    uint32_t epilogue = b->size;
+    emitSpill(b);
+    uint32_t restore = b->size;
+    emit(b, 0x48);
+    emit(b, 0x83);
+    emit(b, 0xc4);
+    emit(b, 0x08); // add rsp, 8
+    for(int8_t i = sizeof(saved) - 2;i >= 0;i--)
+        emitPop(b, saved[i]);
+    emit(b, 0xc3);
+
+    for(uint32_t i = 0;i < exitCount;i++){
+        patch(b, exits[i].at, b->size);
+        if(exits[i].flags != FLAGS_SETTLED)
+            emitFlagSpill(b, exits[i].flags);
+        if(exits[i].kind == EXIT_WRITTEN){
+            emitCall(b, (void *)helper_written, exits[i].store, 4);
+            emitMovImm(b, RAX, exits[i].pc);
+            patch(b, emitJmp(b), restore);
+        }
+        else{
+            emitMovImm(b, RAX, exits[i].pc);
+            patch(b, emitJmp(b), epilogue);
+        }
+    }
+
+    uint8_t *entry = jit->arena + jit->used;
+    if(mprotect(jit->arena, ARENA_SIZE, PROT_READ | PROT_WRITE) != 0)
+        return -1;
+    memcpy(entry, b->code, b->size);
+    // Blocks start on a boundary, for emitAlign
+    jit->used += (b->size + 31) & ~31u;
+    if(mprotect(jit->arena, ARENA_SIZE, PROT_READ | PROT_EXEC) != 0)
+        return -1;
+
+    jit->blocks = (Block *)realloc(jit->blocks, sizeof(Block) * (jit->blockCount + 1));
+    jit->blocks[jit->blockCount] = (Block){start, low, high, entry, true};
+    return jit->blockCount++;
+}
+
+int32_t jit_compile(VirtualMachine *machine, uint32_t offset){
+    struct Jit *jit = machine->jit;
+    // Only hot loops are compiled when tracing
+    if(jit->tracing || jit->used + MAX_BLOCK_CODE > ARENA_SIZE)
+        return -1;
+    // Patched code is left to the interpreter, without a prologue
+    Operation first;
+    if(!bc_decode_op(machine->memory, offset, machine->memSize, &first) || isModified(jit, offset, first.length))
+        return -1;
+
+    Buffer b = {jit->scratch, 0};
+    Exit exits[MAX_BLOCK_LENGTH * 4 + 1];
+    uint32_t exitCount = 0;
+    // Bytecode offset and native position of each compiled instruction
+    uint32_t starts[MAX_BLOCK_LENGTH], positions[MAX_BLOCK_LENGTH];
+    // The operation pending in FLAG_A and FLAG_B at each instruction,
+    // and what the instruction does to them
+    uint8_t flagsAt[MAX_BLOCK_LENGTH], effects[MAX_BLOCK_LENGTH];
+    uint8_t pending = FLAGS_SETTLED;
+    uint32_t count = 0, pc = offset;
+    uint32_t heads[MAX_BLOCK_LENGTH];
+    uint32_t headCount = loopHeads(machine, offset, heads);
+    // Range of the bytecode compiled into the block
+    uint32_t low = offset, high = offset;
+
+    emitPrologue(&b);
+
+    // open turns false at an instruction which is not compiled,
+    // ended at an unconditional jump
+    bool open = true, ended = false;
+    while(!ended && count < MAX_BLOCK_LENGTH){
+        Operation op;
+        if(!bc_decode_op(machine->memory, pc, machine->memSize, &op) || isModified(jit, pc, op.length))
+            break;
+
+        uint32_t next = pc + op.length;
+        for(uint32_t i = 0;i < headCount;i++){
+            if(heads[i] == pc){
+                emitAlign(&b);
+                break;
+            }
+        }
+        uint32_t start = b.size;
+        uint32_t firstExit = exitCount;
+        uint8_t entered = pending, effect = EFFECT_NONE;
+
+        switch(op.opcode){
+            case OP_jeq:
+            case OP_jne:
+            case OP_jgt:
+            case OP_jlt:
+            case OP_jeqi:
+            case OP_jnei:
+            case OP_jgti:
+            case OP_jlti:
+            case OP_loop:{
+                uint32_t target = op.val[0] > machine->memSize ? machine->memSize : op.val[0];
+                // loop writes its register, which may hold the operand
+                // of a deferred incr or decr
+                if((pending >> 3) != 0 && destination(&op) == (pending >> 3) - 1)
+                    pending = emitFlagOperand(&b, pending);
+                uint8_t cc = emitCompare(&b, &op);
+                // Jumps back into the block stay native
+                bool inside = false;
+                for(uint32_t i = 0;i < count;i++){
+                    if(starts[i] == target){
+                        // Skip over the back edge when not taken
+                        uint32_t at = emitJcc(&b, cc ^ 1);
+                        if(flagsMerge(&b, flagsAt, effects, i, count, pending)){
+                            emitBackEdge(&b, exits, &exitCount, target, positions[i], count - i + 1);
+                            inside = true;
+                        }
+                        else
+                            exits[exitCount++] = (Exit){emitJmp(&b), target, 0, EXIT_RETURN, 0};
+                        patch(&b, at, b.size);
+                        break;
+                    }
+                }
+                if(!inside)
+                    exits[exitCount++] = (Exit){emitJcc(&b, cc), target, 0, EXIT_RETURN, 0};
+                break;
+            }
+            case OP_jmp:{
+                uint32_t target = op.val[0] > machine->memSize ? machine->memSize : op.val[0];
+                for(uint32_t i = 0;i < count;i++){
+                    if(starts[i] == target){
+                        if(flagsMerge(&b, flagsAt, effects, i, count, pending))
+                            emitBackEdge(&b, exits, &exitCount, target, positions[i], count - i + 1);
+                        else
+                            exits[exitCount++] = (Exit){emitJmp(&b), target, 0, EXIT_RETURN, 0};
+                        ended = true;
+                        break;
+                    }
+                }
+                // Otherwise compilation goes on at the target
+                next = target;
+                break;
+            }
+            default:
+                open = emitOperation(machine, &b, &op, next, exits, &exitCount, &pending, &effect);
+                break;
+        }
+
+        if(!open)
+            break;
+        // The exits write back whatever is pending
+        for(uint32_t i = firstExit;i < exitCount;i++)
+            exits[i].flags = pending;
+        starts[count] = pc;
+        positions[count] = start;
+        flagsAt[count] = entered;
+        effects[count] = exitCount > firstExit ? EFFECT_READS : effect;
+        count++;
+        for(uint32_t i = pc;i < pc + op.length;i++)
+            machine->codeMap[i] |= JIT_CODEMAP_BIT;
+        low = pc < low ? pc : low;
+        high = pc + op.length > high ? pc + op.length : high;
+        pc = next;
+    }
+
+    if(count == 0)
+        return -1;
+
+    // Falling off the end of the block
+    if(!ended)
+        exits[exitCount++] = (Exit){emitJmp(&b), pc, 0, EXIT_RETURN, pending};
+
+    int32_t block = install(machine, &b, exits, exitCount, offset, low, high);
+
+#ifdef DEBUG
+    output_flush(&machine->output);
+    dbg("Compiled " ANSI_FONT_BOLD "%" PRIu32 ANSI_COLOR_RESET " instructions at offset "
+            ANSI_FONT_BOLD "%04" PRIu32 ANSI_COLOR_RESET " to %" PRIu32 " bytes", count, offset, b.size);
+#endif
+
+    return block;
+}
+
+/* Traces
+ * ======
+ *
+ * When tracing, blocks are only compiled for the loops which the
+ * interpreter finds hot, at a backward jump which it took
+ * JIT_HOT_LOOP times. The trace is the path the next trip through
+ * the loop takes. It is recorded by stepping the instructions from
+ * the head of the loop on a copy of the registers, with the stores
+ * kept aside, until the path comes back to the head. The trace is
+ * then compiled as a straight line, where each conditional jump is
+ * a guard which leaves the block, with the PC of the path it did
+ * not record, and its end jumps back to its start. A path which
+ * runs into an instruction the JIT leaves to the interpreter, or
+ * does not come back within MAX_BLOCK_LENGTH instructions, is not
+ * compiled, and its loop is not tried again.
+ *
+ * The recording only picks the path, the guards keep the block
+ * right when the loop goes another way, so a store which the
+ * recording misses, like one which partly overlaps a later load,
+ * costs an early exit at worst.
+ */
+
+typedef struct{
+    uint32_t pc;
+    Operation op;
+    bool taken; // whether a conditional jump jumped
+} TraceStep;
+
+// A long of the memory as the recorded path sees it, the last
+// store to the same offset if there is one
+static uint32_t peek(VirtualMachine *machine, const uint32_t *stores, const uint32_t *values, uint32_t count, uint32_t address){
+    for(uint32_t i = count;i > 0;i--)
+        if(stores[i - 1] == address)
+            return values[i - 1];
+    return readLong(machine, address);
+}
+
+// Records the path from head back to it, returns the number of
+// steps, or zero if it can not be compiled
+static uint32_t record(VirtualMachine *machine, uint32_t head, const int32_t *registers, TraceStep *steps){
+    int32_t regs[8];
+    memcpy(regs, registers, sizeof(regs));
+    uint32_t stores[MAX_BLOCK_LENGTH], values[MAX_BLOCK_LENGTH];
+    uint32_t storeCount = 0, count = 0, pc = head;
+
+    while(count < MAX_BLOCK_LENGTH){
+        TraceStep *step = &steps[count];
+        Operation *op = &step->op;
+        if(!bc_decode_op(machine->memory, pc, machine->memSize, op) || isModified(machine->jit, pc, op->length))
+            return 0;
+        step->pc = pc;
+        step->taken = false;
+        uint32_t next = pc + op->length;
+        int32_t *x = &regs[op->reg[0]], *y = &regs[op->reg[1]];
+        switch(op->opcode){
+            case OP_add: *y = (uint32_t)*x + (uint32_t)*y; break;
+            case OP_sub: *y = (uint32_t)*x - (uint32_t)*y; break;
+            case OP_mul: *y = (uint32_t)*x * (uint32_t)*y; break;
+            case OP_and: *y = *x & *y; break;
+            case OP_or: *y = *x | *y; break;
+            case OP_not: *x = ~*x; break;
+            case OP_lshift: *x = (uint32_t)*x << (op->val[0] & 31); break;
+            case OP_rshift: *x = *x >> (op->val[0] & 31); break;
+            case OP_incr: *x = (uint32_t)*x + 1; break;
+            case OP_decr: *x = (uint32_t)*x - 1; break;
+            case OP_mov: *x = op->val[0]; break;
+            case OP_rcopy: *y = *x; break;
+            case OP_addi: *x = (uint32_t)*x + op->val[0]; break;
+            case OP_subi: *x = (uint32_t)*x - op->val[0]; break;
+            case OP_muli: *x = (uint32_t)*x * op->val[0]; break;
+            case OP_andi: *x = *x & op->val[0]; break;
+            case OP_ori: *x = *x | op->val[0]; break;
+            case OP_lshiftr: *x = (uint32_t)*x << (*y & 31); break;
+            case OP_rshiftr: *x = *x >> (*y & 31); break;
+            case OP_load:
+                if(!fits(machine, op->val[0], 4))
+                    return 0;
+                *x = peek(machine, stores, values, storeCount, op->val[0]);
+                break;
+            case OP_store:
+            case OP_save:
+            case OP_mcopy:{
+                uint32_t address = op->opcode == OP_store ? op->val[0] : op->val[1];
+                if(!fits(machine, address, 4) || (op->opcode == OP_mcopy && !fits(machine, op->val[0], 4)))
+                    return 0;
+                if(op->opcode == OP_store)
+                    values[storeCount] = *x;
+                else if(op->opcode == OP_save)
+                    values[storeCount] = op->val[0];
+                else
+                    values[storeCount] = peek(machine, stores, values, storeCount, op->val[0]);
+                stores[storeCount++] = address;
+                break;
+            }
+            case OP_print:
+            case OP_printc:
+            case OP_prints:
+            case OP_clrsr:
+                break;
+            case OP_jeq: step->taken = *x == *y; break;
+            case OP_jne: step->taken = *x != *y; break;
+            case OP_jgt: step->taken = *x > *y; break;
+            case OP_jlt: step->taken = *x < *y; break;
+            case OP_jeqi: step->taken = *x == (int32_t)op->val[1]; break;
+            case OP_jnei: step->taken = *x != (int32_t)op->val[1]; break;
+            case OP_jgti: step->taken = *x > (int32_t)op->val[1]; break;
+            case OP_jlti: step->taken = *x < (int32_t)op->val[1]; break;
+            case OP_loop:
+                *x = (uint32_t)*x - 1;
+                step->taken = *x != 0;
+                break;
+            case OP_jmp:
+                step->taken = true;
+                break;
+            default:
+                return 0;
+        }
+        if(step->taken)
+            next = op->val[0];
+        count++;
+        if(next == head)
+            return count;
+        if(next >= machine->memSize)
+            return 0;
+        pc = next;
+    }
+    return 0;
+}
+
+int32_t jit_trace(VirtualMachine *machine, uint32_t head, const int32_t *registers){
+    struct Jit *jit = machine->jit;
+    if(jit->used + MAX_BLOCK_CODE > ARENA_SIZE)
+        return -1;
+    TraceStep steps[MAX_BLOCK_LENGTH];
+    uint32_t count = record(machine, head, registers, steps);
+    if(count == 0)
+        return -1;
+
+    Buffer b = {jit->scratch, 0};
+    Exit exits[MAX_BLOCK_LENGTH * 4 + 1];
+    uint32_t exitCount = 0;
+    uint8_t flagsAt[MAX_BLOCK_LENGTH], effects[MAX_BLOCK_LENGTH];
+    uint8_t pending = FLAGS_SETTLED;
+    uint32_t low = head, high = head;
+
+    emitPrologue(&b);
+    emitAlign(&b);
+    uint32_t loop = b.size;
+    for(uint32_t i = 0;i < count;i++){
+        const Operation *op = &steps[i].op;
+        uint32_t pc = steps[i].pc, next = pc + op->length;
+        uint32_t firstExit = exitCount;
+        uint8_t entered = pending, effect = EFFECT_NONE;
+
+        switch(op->opcode){
+            case OP_jeq:
+            case OP_jne:
+            case OP_jgt:
+            case OP_jlt:
+            case OP_jeqi:
+            case OP_jnei:
+            case OP_jgti:
+            case OP_jlti:
+            case OP_loop:{
+                uint32_t target = op->val[0] > machine->memSize ? machine->memSize : op->val[0];
+                if((pending >> 3) != 0 && destination(op) == (pending >> 3) - 1)
+                    pending = emitFlagOperand(&b, pending);
+                uint8_t cc = emitCompare(&b, op);
+                // Leave where the loop goes the other way
+                if(steps[i].taken)
+                    exits[exitCount++] = (Exit){emitJcc(&b, cc ^ 1), next, 0, EXIT_RETURN, 0};
+                else
+                    exits[exitCount++] = (Exit){emitJcc(&b, cc), target, 0, EXIT_RETURN, 0};
+                break;
+            }
+            case OP_jmp:
+                break;
+            default:
+                if(!emitOperation(machine, &b, op, next, exits, &exitCount, &pending, &effect))
+                    return -1;
+                break;
+        }
+
+        for(uint32_t j = firstExit;j < exitCount;j++)
+            exits[j].flags = pending;
+        flagsAt[i] = entered;
+        effects[i] = exitCount > firstExit ? EFFECT_READS : effect;
+        low = pc < low ? pc : low;
+        high = next > high ? next : high;
+    }
+
+    // Back to the start, the flags there are in the machine
+    uint32_t firstExit = exitCount;
+    flagsMerge(&b, flagsAt, effects, 0, count, pending);
+    emitBackEdge(&b, exits, &exitCount, head, loop, count);
+    exits[firstExit].flags = pending;
+
+    for(uint32_t i = 0;i < count;i++)
+        for(uint32_t j = steps[i].pc;j < steps[i].pc + steps[i].op.length;j++)
+            machine->codeMap[j] |= JIT_CODEMAP_BIT;
+
+    int32_t block = install(machine, &b, exits, exitCount, head, low, high);
+
+#ifdef DEBUG
+    output_flush(&machine->output);
+    dbg("Traced " ANSI_FONT_BOLD "%" PRIu32 ANSI_COLOR_RESET " instructions from offset "
+            ANSI_FONT_BOLD "%04" PRIu32 ANSI_COLOR_RESET " to %" PRIu32 " bytes", count, head, b.size);
+#endif
+
+    return block;
+}
+
+uint32_t jit_execute(VirtualMachine *machine, uint32_t block){
+    return ((NativeBlock)(void *)machine->jit->blocks[block].entry)(machine);
+}
+
+void jit_invalidate(VirtualMachine *machine, uint32_t offset, uint32_t bytes){
+    struct Jit *jit = machine->jit;
+    for(uint32_t i = 0;i < jit->blockCount;i++){
+        Block *block = &jit->blocks[i];
+        if(block->live && block->low < offset + bytes && offset < block->high){
+            block->live = false;
+            memset(&machine->code[block->start], 0, sizeof(Instruction));
+        }
+    }
+    for(uint32_t i = offset;i < offset + bytes && i < machine->memSize;i++){
+        jit->modified[i] = 1;
+        machine->codeMap[i] &= ~JIT_CODEMAP_BIT;
+    }
+}
+
+bool jit_enable(VirtualMachine *machine){
+    struct Jit *jit = (struct Jit *)malloc(sizeof(struct Jit));
+    if(jit == NULL)
+        return false;
+    jit->arena = (uint8_t *)mmap(NULL, ARENA_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    jit->modified = (uint8_t *)calloc(machine->memSize + 1, sizeof(uint8_t));
+    jit->scratch = (uint8_t *)malloc(MAX_BLOCK_CODE);
+    if(jit->arena == MAP_FAILED || jit->modified == NULL || jit->scratch == NULL){
+        if(jit->arena != MAP_FAILED)
+            munmap(jit->arena, ARENA_SIZE);
+        free(jit->modified);
+        free(jit->scratch);
+        free(jit);
+        return false;
+    }
+    jit->used = 0;
+    jit->tracing = false;
+    jit->blocks = NULL;
+    jit->blockCount = 0;
+    machine->jit = jit;
+    return true;
+}
+
+bool jit_enable_tracing(VirtualMachine *machine){
+    if(!jit_enable(machine))
+        return false;
+    machine->jit->tracing = true;
+    return true;
+}
+
+bool jit_tracing(VirtualMachine *machine){
+    return machine->jit != NULL && machine->jit->tracing;
+}
+
+void jit_free(VirtualMachine *machine){
+    struct Jit *jit = machine->jit;
+    if(jit == NULL)
+        return;
+    munmap(jit->arena, ARENA_SIZE);
+    free(jit->blocks);
+    free(jit->modified);
+    free(jit->scratch);
+    free(jit);
+    machine->jit = NULL;
+}
+
+#else
+
+bool jit_enable(VirtualMachine *machine){
+    (void)machine;
+    err("The JIT is only available on x86-64 hosts!");
+    return false;
+}
+
+bool jit_enable_tracing(VirtualMachine *machine){
+    return jit_enable(machine);
+}
+
+bool jit_tracing(VirtualMachine *machine){
+    (void)machine;
+    return false;
+}
+
+void jit_free(VirtualMachine *machine){
+    (void)machine;
+}
+
+int32_t jit_compile(VirtualMachine *machine, uint32_t offset){
+    (void)machine;
+    (void)offset;
+    return -1;
+}
+
+int32_t jit_trace(VirtualMachine *machine, uint32_t head, const int32_t *registers){
+    (void)machine;
+    (void)head;
+    (void)registers;
+    return -1;
+}
+
+uint32_t jit_execute(VirtualMachine *machine, uint32_t block){
+    (void)block;
+    return machine->PC;
+}
+
+void jit_invalidate(VirtualMachine *machine, uint32_t offset, uint32_t bytes){
+    (void)machine;
+    (void)offset;
+    (void)bytes;
+}
+
+#endif
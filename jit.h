@@ -0,0 +1,25 @@
+#pragma once
+#include "rm_common.h"
+#include "vm.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Bit of VirtualMachine::codeMap marking bytes compiled to native code
+#define JIT_CODEMAP_BIT 2
+
+// Taken trips of a backward jump after which its loop is traced
+#define JIT_HOT_LOOP 64
+// Traces compiled for a loop at most, as it changes its path
+#define JIT_MAX_TRACES 4
+
+bool jit_enable(VirtualMachine *machine);
+// Compiles only the loops the interpreter finds hot, as traces
+bool jit_enable_tracing(VirtualMachine *machine);
+bool jit_tracing(VirtualMachine *machine);
+void jit_free(VirtualMachine *machine);
+int32_t jit_compile(VirtualMachine *machine, uint32_t offset);
+// Compiles the loop at head, along the path it takes from the given
+// registers. Returns the block, or -1 if it can not be compiled.
+int32_t jit_trace(VirtualMachine *machine, uint32_t head, const int32_t *registers);
+uint32_t jit_execute(VirtualMachine *machine, uint32_t block);
+void jit_invalidate(VirtualMachine *machine, uint32_t offset, uint32_t bytes);
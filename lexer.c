@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -19,6 +20,7 @@ static Token keywords[] = {
 static char* source = NULL;
 static size_t present = 0, length = 0, start = 0, line = 1;
 static Token lastToken;
+static bool inAddress = false;
 
 static void addToken(TokenList *list, Token token){
     list->tokens = (Token *)realloc(list->tokens, sizeof(Token) * (++list->count));
@@ -88,6 +90,14 @@ static Token makeKeyword(){
         word[i - start] = source[i];
     };
     word[present - start] = '\0';
+    // A keyword is a label where one is declared or referred to,
+    // so that opcodes added later do not break older programs
+    size_t next = present;
+    while(source[next] == ' ' || source[next] == '\t')
+        next++;
+    if(lastToken.type == TOKEN_address || source[next] == ':')
+        return makeToken(TOKEN_label);
+
     for(uint32_t i = 0;i < sizeof(keywords)/sizeof(Token);i++){
         if(keywords[i].length == (present - start)){
             if(strcmp(keywords[i].string, word) == 0){
@@ -139,6 +149,26 @@ static Token nextToken(){
         case ':':
             present++;
             return makeToken(TOKEN_colon);
+        case '.':
+            present++;
+            return makeToken(TOKEN_dot);
+        // Only known inside an address
+        case ']':
+            if(!inAddress)
+                break;
+            present++;
+            inAddress = false;
+            return makeToken(TOKEN_rbracket);
+        case '+':
+            if(!inAddress)
+                break;
+            present++;
+            return makeToken(TOKEN_plus);
+        case '*':
+            if(!inAddress)
+                break;
+            present++;
+            return makeToken(TOKEN_star);
         case '#':
             present++;
             return makeToken(TOKEN_hash);
@@ -160,6 +190,14 @@ static Token nextToken(){
                 present++;
             return t;
         case '[':
+            // An address, if it is an operand on the line of
+            // its instruction, a comment otherwise
+            if(lastToken.line == line && (lastToken.type == TOKEN_comma || lastToken.type == TOKEN_load
+                        || lastToken.type == TOKEN_print)){
+                present++;
+                inAddress = true;
+                return makeToken(TOKEN_lbracket);
+            }
             present++;
             while(present < length && source[present] != ']'){
                 if(source[present] == '\n')
@@ -201,11 +239,14 @@ static Token nextToken(){
     return makeToken(TOKEN_unknown);
 }
 
-TokenList tokens_scan(const char* line){
-    source = strdup(line);
+TokenList tokens_scan(const char* input){
+    source = strdup(input);
     length = strlen(source);
     present = 0;
     start = 0;
+    line = 1;
+    lastToken.type = TOKEN_eof;
+    inAddress = false;
 
     TokenList list = {source, NULL, 0, 0};
     while(present < length){
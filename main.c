@@ -5,6 +5,12 @@
 #include "lexer.h"
 #include "parser.h"
 #include "display.h"
+#include "jit.h"
+#include "batch.h"
+#include "bench.h"
+#include "profile.h"
+#include "sampler.h"
+#include "sourcemap.h"
 
 #ifdef DEBUG
 #include <time.h>
@@ -29,6 +35,9 @@ static void printTime(clock_t start, clock_t end, const char *job){
 
 #endif
 
+// Microseconds of CPU time between the samples of -f
+#define SAMPLE_INTERVAL 1000
+
 static char* read_whole_file(const char* fileName){
     struct stat statbuf;
     stat(fileName, &statbuf);
@@ -60,6 +69,31 @@ static char* read_whole_file(const char* fileName){
 /* -r : compiles and runs a source file
  * -e : executes a binary file
  * -c : compiles and saves a source file
+ * -s : prints superinstruction statistics after running
+ * -j : runs with the JIT compiler
+ * -l : runs with the tracing JIT, which compiles
+ *      only the hot loops
+ * -p : prints the hottest instructions after running
+ * -f : samples the PC while running, prints the hottest
+ *      lines, and saves them as folded stacks to the
+ *      given file
+ * -g : saves source lines and labels in the executable,
+ *      for -p and -f to show when it is run
+ * -b : runs a batch of sources and/or executables
+ * -t : number of workers for the batch, one per
+ *      core by default
+ * -k : number of longs the stack holds, 1024 by
+ *      default
+ * -a : checks each memory access while running
+ * -d : prints each instruction before running it
+ * -m : runs the benchmark workloads, from the root
+ *      of the repository
+ * -o : saves the results of the benchmark to the
+ *      given file, as JSON
+ * -i : compares the benchmark with the results saved
+ *      to the given file
+ * -y : percent by which a workload may get slower
+ *      than the saved results, 10 by default
  *
  *  Additional arguments must be provided to
  *  denote the input file and/or output file
@@ -74,23 +108,49 @@ static void usage(const char *name){
     pylw("%s -c input_file output_file", name);
     printf(ANSI_FONT_BOLD "\n3. Run a compiled executable\n" ANSI_COLOR_RESET);
     pylw("%s -e input_file\n", name);
+    printf(ANSI_FONT_BOLD "\nAdd -s while running to show superinstruction statistics\n" ANSI_COLOR_RESET);
+    pylw("%s -r -s input_file\n", name);
+    printf(ANSI_FONT_BOLD "\nAdd -j while running to compile the program to native code\n" ANSI_COLOR_RESET);
+    pylw("%s -r -j input_file\n", name);
+    printf(ANSI_FONT_BOLD "\nAdd -l instead to compile only the hot loops, as traces\n" ANSI_COLOR_RESET);
+    pylw("%s -r -l input_file\n", name);
+    printf(ANSI_FONT_BOLD "\nAdd -p while running to profile the program\n" ANSI_COLOR_RESET);
+    pylw("%s -r -p input_file\n", name);
+    printf(ANSI_FONT_BOLD "\nAdd -f while running to sample the program, and save the samples for a flame graph\n" ANSI_COLOR_RESET);
+    pylw("%s -r -f output_file input_file\n", name);
+    printf(ANSI_FONT_BOLD "\nAdd -g while compiling to keep the source lines in the executable\n" ANSI_COLOR_RESET);
+    pylw("%s -c -g input_file output_file\n", name);
+    printf(ANSI_FONT_BOLD "\nAdd -k while running to change the number of longs the stack holds\n" ANSI_COLOR_RESET);
+    pylw("%s -r -k 4096 input_file\n", name);
+    printf(ANSI_FONT_BOLD "\nAdd -a while running to check each memory access, and -d to trace each instruction\n" ANSI_COLOR_RESET);
+    pylw("%s -r -a -d input_file\n", name);
+    printf(ANSI_FONT_BOLD "\n4. Run a batch of sources and executables in parallel\n" ANSI_COLOR_RESET);
+    pylw("%s -b [-t workers] input_files...\n", name);
+    printf(ANSI_FONT_BOLD "\n5. Run the benchmark workloads, from the root of the repository\n" ANSI_COLOR_RESET);
+    pylw("%s -m [-o results.json] [-i baseline.json] [-y percent]\n", name);
 }
 
 int main(int argc, char *argv[]){
 
     // Argument parsing
 
-    if(argc != 3 && argc != 4){
+    if(argc < 3){
         err("Wrong arguments!");
         usage(argv[0]);
         return 1;
     }
 
-    int opt, mode = 0;
-    char *source = NULL, *outputFile = NULL;
+    int opt, mode = 0, showStats = 0, useJit = 0, useProfile = 0, keepLines = 0, workers = 0;
+    uint8_t variant = RM_UNCHECKED; // flags added to those of the machine
+    long stackSize = RM_STACK_SIZE;
+    char *source = NULL, *outputFile = NULL, *samplesFile = NULL, *inputFile = NULL;
+    char *resultsFile = NULL, *baselineFile = NULL; // of the benchmark
+    double threshold = BENCH_THRESHOLD;
+    SourceMap map; // lines and labels of the program, if they are needed
+    sourcemap_init(&map);
     Data binaryData = (Data){NULL, 0}; // Bytecode container
     
-    while((opt = getopt(argc, argv, "rec")) != -1){
+    while((opt = getopt(argc, argv, "recsjlpgf:bt:k:admo:i:y:")) != -1){
         switch(opt){
             case 'r':
                 mode += 3;
@@ -101,6 +161,57 @@ int main(int argc, char *argv[]){
             case 'c':
                 mode += 7;
                 break;
+            case 's':
+                showStats = 1;
+                break;
+            case 'j':
+                useJit = 1;
+                break;
+            case 'l':
+                useJit = 2;
+                break;
+            case 'p':
+                useProfile = 1;
+                break;
+            case 'g':
+                keepLines = 1;
+                break;
+            case 'f':
+                samplesFile = optarg;
+                break;
+            case 'b':
+                mode += 11;
+                break;
+            case 't':
+                workers = atoi(optarg);
+                if(workers < 1)
+                    goto end;
+                break;
+            case 'k':
+                stackSize = atol(optarg);
+                if(stackSize < 1 || stackSize > UINT32_MAX / 4)
+                    goto end;
+                break;
+            case 'a':
+                variant |= RM_CHECKED;
+                break;
+            case 'd':
+                variant |= RM_TRACED;
+                break;
+            case 'm':
+                mode += 13;
+                break;
+            case 'o':
+                resultsFile = optarg;
+                break;
+            case 'i':
+                baselineFile = optarg;
+                break;
+            case 'y':
+                threshold = atof(optarg);
+                if(threshold <= 0)
+                    goto end;
+                break;
             default:
 end:
                 err("Wrong arguments!");
@@ -108,9 +219,23 @@ end:
                 return 1;
         }
     }
-    if(mode != 3 && mode != 5 && mode != 7){
+    if(mode != 3 && mode != 5 && mode != 7 && mode != 11 && mode != 13){
         goto end;
     }
+    if(useProfile && samplesFile != NULL){
+        err("Give only one of -p and -f!");
+        return 1;
+    }
+    if(mode == 11){
+        if(optind >= argc){
+            err("Give the files to execute!");
+            usage(argv[0]);
+            return 1;
+        }
+        return !batch_run(&argv[optind], argc - optind, workers, useJit);
+    }
+    if(mode == 13)
+        return !bench_run(resultsFile, baselineFile, threshold, useJit == 1, variant);
     switch(mode){
         case 3:
             if(optind >= argc){
@@ -119,6 +244,7 @@ end:
                 return 1;
             }
             else if(optind == (argc - 1)){
+                inputFile = argv[optind];
                 source = read_whole_file(argv[optind]);
                 if(source == NULL){
                     err("Unable to read input file : " 
@@ -162,7 +288,8 @@ end:
                 return 1;
             }
             else if(optind == (argc - 1)){
-                binaryData = bc_read_from_disk(argv[optind]);
+                inputFile = argv[optind];
+                binaryData = bc_read_from_disk(argv[optind], &map);
                 if(binaryData.size == 0){
                     err("Unable to start virtual machine!\n");
                     return 1;
@@ -212,7 +339,8 @@ end:
 #endif
 
     if(l.hasError==0){
-        if(parse_and_emit(l, &machine->memory, &machine->memSize, 0)){
+        if(parse_and_map(l, &machine->memory, &machine->memSize, 0,
+                    useProfile || samplesFile != NULL || keepLines ? &map : NULL)){
 
 #ifdef DEBUG
             end = clock();
@@ -245,7 +373,7 @@ execute:;
                 dbg("===== Saving ======\n");
 #endif          
 
-                if(bc_save_to_disk(outputFile, machine->memory, machine->memSize))
+                if(bc_save_to_disk(outputFile, machine->memory, machine->memSize, keepLines ? &map : NULL))
                     printf(ANSI_COLOR_GREEN ANSI_FONT_BOLD "\n[Done] " ANSI_COLOR_RESET
                             "Compiled and saved to file : " 
                             ANSI_COLOR_CYAN ANSI_FONT_BOLD "%s" ANSI_COLOR_RESET "!\n", outputFile);
@@ -258,6 +386,18 @@ execute:;
             start = clock();
 #endif
 
+            if(!rm_stack(machine, stackSize))
+                err("Unable to allocate the stack, running with the default one!\n");
+            if(!rm_variant(machine, machine->variant | variant))
+                err("Unable to change the interpreter, running on the default one!\n");
+            if(useProfile && !rm_profile(machine))
+                err("Unable to allocate the profile, running without it!\n");
+            else if(samplesFile != NULL && !rm_sample(machine, SAMPLE_INTERVAL))
+                err("Unable to allocate the samples, running without them!\n");
+            else if(useJit == 1 && !jit_enable(machine))
+                err("Unable to start the JIT, running on the interpreter!\n");
+            else if(useJit == 2 && !jit_enable_tracing(machine))
+                err("Unable to start the JIT, running on the interpreter!\n");
             rm_run(machine, 0);
 
 #ifdef DEBUG
@@ -266,6 +406,17 @@ execute:;
 #endif
 
             printf("\n");
+            if(showStats)
+                rm_print_superinstructions(machine);
+            if(machine->profile != NULL)
+                profile_print(machine->profile, machine->memory, map.lineCount > 0 ? &map : NULL, 20);
+            if(machine->sampler != NULL){
+                sampler_print(machine->sampler, map.lineCount > 0 ? &map : NULL, 20);
+                // Stacks are rooted at the name of the program
+                const char *root = strrchr(inputFile, '/') == NULL ? inputFile : strrchr(inputFile, '/') + 1;
+                if(!sampler_export(machine->sampler, map.lineCount > 0 ? &map : NULL, root, samplesFile))
+                    err("Unable to save the samples to given file!\n");
+            }
         }
         else if(!outputFile)
             err("Unable to start virtual machine!\n");
@@ -289,5 +440,6 @@ done:
         free(source);
         tokens_free(l);
     }
+    sourcemap_free(&map);
     rm_free(machine);
 }
@@ -65,10 +65,10 @@ OPCODE(jgt, 7, 3)
 OPCODE(jlt, 7, 3)
 
 // jov @32
-OPCODE(jov, 4, 3)
+OPCODE(jov, 5, 3)
 
 // jun @32
-OPCODE(jun, 4, 3)
+OPCODE(jun, 5, 3)
 
 // clrpc
 OPCODE(clrpc, 1, 5)
@@ -139,3 +139,298 @@ OPCODE(decr, 2, 4)
 //
 // prints @offset, #23
 OPCODE(prints, 9, 6)
+
+// Reserves a number of zeroed bytes at
+// present offset, for buffers
+//
+// space #1024
+OPCODE(space, 1, 5)
+
+// Copies a number of bytes, held by a
+// register, from a memory offset to
+// another. The ranges may overlap.
+//
+// bcopy @offset_from, @offset_to, r0
+OPCODE(bcopy, 10, 5)
+
+// Fills a number of bytes, held by the
+// second register, with the lowest byte
+// of the first one
+//
+// bfill r0, @offset, r1
+OPCODE(bfill, 7, 5)
+
+// Compares a number of bytes, held by the
+// first register, at two memory offsets,
+// and sets the second one to -1, 0 or 1,
+// like memcmp
+//
+// bcmp @offset_a, @offset_b, r0, r1
+OPCODE(bcmp, 11, 4)
+
+/* Vector operations
+ * =================
+ *
+ * They work on runs of longs, the number of which
+ * is held by a register, and do not touch SR.
+ *
+ * The element-wise ones store op(from[i], to[i])
+ * at to[i], like their register counterparts
+ *
+ * vadd @offset_from, @offset_to, r0
+ */
+OPCODE(vadd, 10, 4)
+
+// vsub @offset_from, @offset_to, r0
+OPCODE(vsub, 10, 4)
+
+// vmul @offset_from, @offset_to, r0
+OPCODE(vmul, 10, 4)
+
+// vand @offset_from, @offset_to, r0
+OPCODE(vand, 10, 4)
+
+// vor @offset_from, @offset_to, r0
+OPCODE(vor, 10, 3)
+
+// The reductions store the wrapping sum, or the
+// signed minimum or maximum, of the longs in the
+// second register
+//
+// vsum @offset, r0, r1
+OPCODE(vsum, 7, 4)
+
+// vmin @offset, r0, r1
+OPCODE(vmin, 7, 4)
+
+// vmax @offset, r0, r1
+OPCODE(vmax, 7, 4)
+
+/* Sub-register operations
+ * =======================
+ *
+ * The byte and word variants work on a lane of a register,
+ * written as r0.1, lane 0 being the least significant one,
+ * and the default. A register has byte lanes 0 to 3, and word
+ * lanes 0 and 1. Writing a lane leaves the rest of the register
+ * as it is. add and sub wrap around inside the lane, and set SR
+ * as if the lane was a register of its own.
+ *
+ * In the bytecode, a sub-register takes a byte, which holds the
+ * lane in its upper half, and the register in its lower half.
+ *
+ * addb r0.1, r1.2
+ */
+OPCODE(addb, 3, 4)
+
+// addw r0, r1.1
+OPCODE(addw, 3, 4)
+
+// subb r0.1, r1.2
+OPCODE(subb, 3, 4)
+
+// subw r0, r1.1
+OPCODE(subw, 3, 4)
+
+// andb r0.1, r1.2
+OPCODE(andb, 3, 4)
+
+// andw r0, r1.1
+OPCODE(andw, 3, 4)
+
+// orb r0.1, r1.2
+OPCODE(orb, 3, 3)
+
+// orw r0, r1.1
+OPCODE(orw, 3, 3)
+
+// The immediate takes a byte, or a word, as well
+//
+// movb #255, r0.3
+OPCODE(movb, 3, 4)
+
+// movw #-2, r0.1
+OPCODE(movw, 4, 4)
+
+// loadb @37, r0.1
+OPCODE(loadb, 6, 5)
+
+// loadw @37, r0.1
+OPCODE(loadw, 6, 5)
+
+// storeb r0.1, @43
+OPCODE(storeb, 6, 6)
+
+// storew r0.1, @43
+OPCODE(storew, 6, 6)
+
+/* Indirect addressing
+ * ===================
+ *
+ * load, store and print also take the address from
+ * registers, as a base register, an optional index
+ * register scaled by 1, 2, 4 or 8, and an optional
+ * displacement, which may be a label
+ *
+ * load [r1], r0
+ * store r0, [r1 + #8]
+ * load [r1 + r2*4 + @table], r0
+ * print [r1]
+ *
+ * The parser picks one of the following for them, so they
+ * are not accessible by a source program. The address is
+ * checked each time it is used, as it is only known then.
+ *
+ * In the bytecode, the index register takes a byte, which
+ * holds the shift of its scale in the upper half.
+ *
+ * load [r1 + #8], r0
+ */
+OPCODE(loadr, 7, 0)
+
+// load [r1 + r2*4 + #8], r0
+OPCODE(loadx, 8, 0)
+
+// store r0, [r1 + #8]
+OPCODE(storer, 7, 0)
+
+// store r0, [r1 + r2*4 + #8]
+OPCODE(storex, 8, 0)
+
+// print [r1 + #8]
+OPCODE(printr, 6, 0)
+
+// print [r1 + r2*4 + #8]
+OPCODE(printx, 7, 0)
+
+/* Immediate forms
+ * ===============
+ *
+ * The binary operations also take a constant, in place
+ * of their first register. The register is then both the
+ * operand and the result, like for the shifts, so that
+ *
+ * sub r0, #5
+ *
+ * subtracts 5 from r0. The conditional jumps take one in
+ * place of their second register, and the shifts take a
+ * register in place of their constant.
+ *
+ * Like the indirect forms, the parser picks these for the
+ * usual opcodes, they are not accessible by name.
+ *
+ * add r0, #5
+ */
+OPCODE(addi, 6, 0)
+
+// sub r0, #5
+OPCODE(subi, 6, 0)
+
+// mul r0, #5
+OPCODE(muli, 6, 0)
+
+// div r0, #5
+OPCODE(divi, 6, 0)
+
+// and r0, #5
+OPCODE(andi, 6, 0)
+
+// or r0, #5
+OPCODE(ori, 6, 0)
+
+// jeq r0, #100, @32
+OPCODE(jeqi, 10, 0)
+
+// jne r0, #100, @32
+OPCODE(jnei, 10, 0)
+
+// jgt r0, #100, @32
+OPCODE(jgti, 10, 0)
+
+// jlt r0, #100, @32
+OPCODE(jlti, 10, 0)
+
+// lshift r0, r1
+OPCODE(lshiftr, 3, 0)
+
+// rshift r0, r1
+OPCODE(rshiftr, 3, 0)
+
+/* Subroutines
+ * ===========
+ *
+ * The machine has a stack of longs of its own, outside the
+ * memory, which grows down from its size, and is not reachable
+ * by the other instructions. call pushes the offset of the next
+ * instruction and jumps, ret pops an offset and jumps to it.
+ * Pushing to a full stack, or popping from an empty one, stops
+ * the machine.
+ *
+ * call @routine
+ */
+OPCODE(call, 5, 4)
+
+// ret
+OPCODE(ret, 1, 3)
+
+// push r0
+OPCODE(push, 2, 4)
+
+// pop r0
+OPCODE(pop, 2, 3)
+
+/* Count down loops
+ * ================
+ *
+ * loop decrements a register, and jumps if it did not reach
+ * zero, so that a loop of n trips is
+ *
+ *        mov #n, r0
+ * again : ...
+ *        loop r0, @again
+ *
+ * djnz does the same on a byte lane of a register, which wraps
+ * around inside the lane. Neither of them touches SR.
+ *
+ * loop r0, @again
+ */
+OPCODE(loop, 6, 4)
+
+// djnz r0.1, @again
+OPCODE(djnz, 6, 4)
+
+/* Superinstructions
+ * =================
+ *
+ * The SUPERINSTRUCTION macro should be of format
+ *
+ * SUPERINSTRUCTION(first, second)
+ *
+ * When the VM decodes 'first' immediately followed by
+ * 'second', it runs both with a single dispatch. They
+ * are listed only if the includer asks for them.
+ */
+
+#ifdef SUPERINSTRUCTION
+
+// loop : incr r0
+//        jlt r0, r1, @loop
+SUPERINSTRUCTION(incr, jlt)
+
+// rcopy r1, r2
+// add r0, r1
+SUPERINSTRUCTION(rcopy, add)
+
+// store r1, @storage
+// print @storage
+SUPERINSTRUCTION(store, print)
+
+// decr r0
+// jne r0, r1, @loop
+SUPERINSTRUCTION(decr, jne)
+
+// loop : incr r0
+//        jlt r0, #100, @loop
+SUPERINSTRUCTION(incr, jlti)
+
+#endif
@@ -0,0 +1,90 @@
+#include "output.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+void output_init_fd(RmOutput *output, int fd){
+    output->data = output->buffer;
+    output->size = 0;
+    output->capacity = OUTPUT_BUFFER_SIZE;
+    output->fd = fd;
+    output->grow = false;
+    output->dropped = 0;
+}
+
+void output_init_buffer(RmOutput *output, char *buffer, size_t capacity){
+    output->data = buffer;
+    output->size = 0;
+    output->capacity = capacity;
+    output->fd = -1;
+    output->grow = false;
+    output->dropped = 0;
+}
+
+void output_init_memory(RmOutput *output){
+    output_init_buffer(output, NULL, 0);
+    output->grow = true;
+}
+
+void output_free(RmOutput *output){
+    if(output->grow)
+        free(output->data);
+    output->data = NULL;
+    output->size = output->capacity = 0;
+}
+
+static void writeAll(int fd, const char *bytes, size_t length){
+    // Whatever went through stdio before, like the diagnostics
+    // of display.c, has to come out first
+    fflush(stdout);
+    while(length > 0){
+        ssize_t written = write(fd, bytes, length);
+        if(written < 0){
+            if(errno == EINTR)
+                continue;
+            return;
+        }
+        bytes += written;
+        length -= written;
+    }
+}
+
+void output_flush(RmOutput *output){
+    if(output->fd < 0 || output->size == 0)
+        return;
+    writeAll(output->fd, output->data, output->size);
+    output->size = 0;
+}
+
+void output_overflow(RmOutput *output, const char *bytes, size_t length){
+    if(output->fd >= 0){
+        output_flush(output);
+        if(length >= output->capacity){
+            // Too long to be worth a copy
+            writeAll(output->fd, bytes, length);
+            return;
+        }
+    }
+    else if(output->grow){
+        size_t capacity = output->capacity ? output->capacity : OUTPUT_BUFFER_SIZE;
+        while(capacity - output->size < length)
+            capacity *= 2;
+        char *data = (char *)realloc(output->data, capacity);
+        if(data == NULL){
+            output->dropped += length;
+            return;
+        }
+        output->data = data;
+        output->capacity = capacity;
+    }
+    else{
+        size_t fits = output->capacity - output->size;
+        output->dropped += length - fits;
+        length = fits;
+    }
+    memcpy(output->data + output->size, bytes, length);
+    output->size += length;
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include "rm_common.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Size of the buffer of an output flushed to a descriptor
+#define OUTPUT_BUFFER_SIZE 8192
+
+/* Guest output
+ * ============
+ *
+ * print, printc and prints append to the output of the machine.
+ * An output either fills its own buffer and flushes it to a file
+ * descriptor with write(2), or collects everything in memory, in
+ * a buffer given by the caller or in one which grows as needed.
+ */
+typedef struct{
+    char *data;
+    size_t size, capacity;
+    int fd; // flushed to this descriptor when full, -1 to keep in memory
+    bool grow; // data is allocated here, and grows as needed
+    size_t dropped; // bytes which did not fit a caller-supplied buffer
+    char buffer[OUTPUT_BUFFER_SIZE];
+} RmOutput;
+
+void output_init_fd(RmOutput *output, int fd);
+void output_init_buffer(RmOutput *output, char *buffer, size_t capacity);
+void output_init_memory(RmOutput *output);
+void output_free(RmOutput *output);
+void output_flush(RmOutput *output);
+// Appends the bytes which do not fit the buffer as it is
+void output_overflow(RmOutput *output, const char *bytes, size_t length);
+
+static inline void output_bytes(RmOutput *output, const char *bytes, size_t length){
+    if(length > output->capacity - output->size){
+        output_overflow(output, bytes, length);
+        return;
+    }
+    for(size_t i = 0;i < length;i++)
+        output->data[output->size + i] = bytes[i];
+    output->size += length;
+}
+
+static inline void output_char(RmOutput *output, char c){
+    if(output->size == output->capacity){
+        output_overflow(output, &c, 1);
+        return;
+    }
+    output->data[output->size++] = c;
+}
+
+static inline void output_int(RmOutput *output, int32_t value){
+    char digits[11];
+    uint32_t magnitude = value < 0 ? 0u - (uint32_t)value : (uint32_t)value;
+    int at = sizeof(digits);
+    do{
+        digits[--at] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while(magnitude);
+    if(value < 0)
+        digits[--at] = '-';
+    output_bytes(output, &digits[at], sizeof(digits) - at);
+}
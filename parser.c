@@ -2,6 +2,8 @@
 #include "bytecode.h"
 #include "vm.h"
 #include "display.h"
+#include "verifier.h"
+#include "sourcemap.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -10,6 +12,7 @@
 
 static uint32_t present = 0, length = 0, presentOffset = 0, memSize = 0, hasErrors = 0;
 static uint8_t *memory;
+static SourceMap *sourceMap = NULL;
 
 static void writeByte(uint8_t byte){
     if(presentOffset >= memSize){
@@ -23,6 +26,17 @@ static void writeByte(uint8_t byte){
         bc_write_byte(memory, &presentOffset, OP_nex);
 }
 
+// Writes a run of zeroed bytes at once, instead of growing the
+// memory a byte at a time
+static void writeZeros(uint32_t bytes){
+    if(presentOffset + bytes > memSize){
+        memory = (uint8_t *)realloc(memory, sizeof(uint8_t) * (presentOffset + bytes));
+        memSize = presentOffset + bytes;
+    }
+    memset(&memory[presentOffset], hasErrors ? OP_nex : 0, bytes);
+    presentOffset += bytes;
+}
+
 static void writeLong(uint32_t l){
     for(uint32_t i = 24;1;i -= 8){
         writeByte(l >> i);
@@ -183,7 +197,7 @@ bool consume(TokenType type){
     }
 }
 
-static void reg(){
+static uint8_t registerNumber(){
     consume(TOKEN_register);
     if(consume(TOKEN_number)){
         char *end;
@@ -192,11 +206,36 @@ static void reg(){
             err("Register number must be < 8, received " ANSI_FONT_BOLD ANSI_COLOR_MAGENTA "%" PRIu64 ANSI_COLOR_RESET, num);
             token_print_source(previousToken, 1);
             hasErrors++;
-            writeByte(0);
+            return 0;
+        }
+        return num;
+    }
+    return 0;
+}
+
+static void reg(){
+    writeByte(registerNumber());
+}
+
+// A lane of a register, as in r0.1, which can be one of lanes.
+// Lane 0 if it is not given.
+static void subreg(uint8_t lanes){
+    uint8_t index = registerNumber(), lane = 0;
+    if(match(TOKEN_dot)){
+        advance();
+        if(consume(TOKEN_number)){
+            char *end;
+            uint64_t num = strtoll(previousToken.string, &end, 10);
+            if(num >= lanes){
+                err("Lane must be < %" PRIu8 ", received " ANSI_FONT_BOLD ANSI_COLOR_MAGENTA "%" PRIu64 ANSI_COLOR_RESET, lanes, num);
+                token_print_source(previousToken, 1);
+                hasErrors++;
+            }
+            else
+                lane = num;
         }
-        else
-            writeByte(num);
     }
+    writeByte((lane << 4) | index);
 }
 
 static void str(){
@@ -272,46 +311,201 @@ static void imm(uint8_t requireUnsigned){
     num(requireUnsigned);
 }
 
-#define TWOREG(name) \
+// An immediate of a byte or a word, which may be given signed
+// or unsigned
+static void narrowImm(uint8_t bytes){
+    consume(TOKEN_hash);
+    int64_t num = 0;
+    if(consume(TOKEN_number)){
+        char *end;
+        int64_t min = -(1 << (bytes * 8 - 1)), max = (1 << (bytes * 8)) - 1;
+        num = strtoll(previousToken.string, &end, 10);
+        if(num < min || num > max){
+            err("Constant must be " ANSI_FONT_BOLD "%" PRId64 ANSI_COLOR_RESET
+                    " <= constant <= " ANSI_FONT_BOLD "%" PRId64 ANSI_COLOR_RESET
+                    ", received " ANSI_FONT_BOLD ANSI_COLOR_MAGENTA "%s" ANSI_COLOR_RESET,
+                    min, max, previousToken.string);
+            token_print_source(previousToken, 1);
+            hasErrors++;
+            num = 0;
+        }
+    }
+    for(uint8_t i = bytes;i > 0;i--)
+        writeByte(num >> ((i - 1) * 8));
+}
+
+/* Indirect addresses
+ * ==================
+ *
+ * [base + index*scale + displacement], where the index and
+ * the displacement are optional. The parts are read first,
+ * since the opcode depends on them, and written after it.
+ */
+
+typedef struct{
+    uint8_t base, index, shift;
+    bool indexed;
+    bool hasLabel; // the displacement is a label
+    Token label;
+    int64_t displacement;
+} Address;
+
+static void address(Address *a){
+    a->index = a->shift = 0;
+    a->indexed = a->hasLabel = false;
+    a->displacement = 0;
+    consume(TOKEN_lbracket);
+    a->base = registerNumber();
+    if(match(TOKEN_plus) && list.tokens[present + 1].type == TOKEN_register){
+        advance();
+        a->indexed = true;
+        a->index = registerNumber();
+        if(match(TOKEN_star)){
+            advance();
+            if(consume(TOKEN_number)){
+                char *end;
+                int64_t scale = strtoll(previousToken.string, &end, 10);
+                if(scale != 1 && scale != 2 && scale != 4 && scale != 8){
+                    err("Scale must be 1, 2, 4 or 8, received " ANSI_FONT_BOLD ANSI_COLOR_MAGENTA "%s" ANSI_COLOR_RESET,
+                            previousToken.string);
+                    token_print_source(previousToken, 1);
+                    hasErrors++;
+                }
+                else
+                    a->shift = __builtin_ctz(scale);
+            }
+        }
+    }
+    if(match(TOKEN_plus)){
+        advance();
+        if(match(TOKEN_address)){
+            advance();
+            if(match(TOKEN_label)){
+                a->hasLabel = true;
+                a->label = presentToken;
+                advance();
+            }
+            else if(consume(TOKEN_number)){
+                char *end;
+                a->displacement = strtoll(previousToken.string, &end, 10);
+                if(a->displacement < 0 || a->displacement > UINT32_MAX){
+                    err("Address must be " ANSI_FONT_BOLD "0" ANSI_COLOR_RESET " <= address <= " ANSI_FONT_BOLD
+                            "%" PRIu32 ANSI_COLOR_RESET ", received " ANSI_FONT_BOLD ANSI_COLOR_MAGENTA "%s" ANSI_COLOR_RESET,
+                            UINT32_MAX, previousToken.string);
+                    token_print_source(previousToken, 1);
+                    hasErrors++;
+                }
+            }
+        }
+        else if(consume(TOKEN_hash) && consume(TOKEN_number)){
+            char *end;
+            a->displacement = strtoll(previousToken.string, &end, 10);
+            if(a->displacement > INT32_MAX || a->displacement < INT32_MIN){
+                err("Displacement must be " ANSI_FONT_BOLD "%" PRId32 ANSI_COLOR_RESET
+                        " <= displacement <= " ANSI_FONT_BOLD "%" PRId32 ANSI_COLOR_RESET
+                        ", received " ANSI_FONT_BOLD ANSI_COLOR_MAGENTA "%s" ANSI_COLOR_RESET,
+                        INT32_MIN, INT32_MAX, previousToken.string);
+                token_print_source(previousToken, 1);
+                hasErrors++;
+            }
+        }
+    }
+    consume(TOKEN_rbracket);
+}
+
+// Writes the base, the index and the displacement of a
+static void writeAddress(const Address *a){
+    writeByte(a->base);
+    if(a->indexed)
+        writeByte((a->shift << 4) | a->index);
+    if(a->hasLabel)
+        addReference(a->label, presentOffset);
+    writeLong(a->displacement);
+}
+
+// The token which starts the operand after the next comma, to
+// pick the form of an instruction before its opcode is written
+static TokenType afterComma(){
+    uint32_t i = present;
+    while(i < length && list.tokens[i].type != TOKEN_comma && list.tokens[i].type != TOKEN_eof)
+        i++;
+    if(i + 1 < length && list.tokens[i].type == TOKEN_comma)
+        return list.tokens[i + 1].type;
+    return TOKEN_eof;
+}
+
+// A divisor, which can not be zero
+static void divisor(uint8_t requireUnsigned){
+    if(match(TOKEN_hash) && list.tokens[present + 1].type == TOKEN_number
+            && strtoll(list.tokens[present + 1].string, NULL, 10) == 0){
+        err("Division by zero!");
+        token_print_source(list.tokens[present + 1], 1);
+        hasErrors++;
+    }
+    imm(requireUnsigned);
+}
+
+#define TWOREG(name, constant) \
     static void statement_##name(){ \
+        if(afterComma() == TOKEN_hash){ \
+            writeByte(OP_##name##i); \
+            reg(); \
+            consume(TOKEN_comma); \
+            constant(0); \
+            return; \
+        } \
         writeByte(OP_##name); \
         reg(); \
         consume(TOKEN_comma); \
         reg(); \
     }
 
-TWOREG(add)
+TWOREG(add, imm)
 
-TWOREG(sub)
+TWOREG(sub, imm)
 
-TWOREG(mul)
+TWOREG(mul, imm)
 
-TWOREG(div)
+TWOREG(div, divisor)
 
-TWOREG(and)
+TWOREG(and, imm)
 
-TWOREG(or)
+TWOREG(or, imm)
 
 static void statement_not(){
     writeByte(OP_not);
     reg();
 }
 
-static void statement_lshift(){
-    writeByte(OP_lshift);
-    reg();
-    consume(TOKEN_comma);
-    imm(1);
-}
+#define parseShift(x) \
+    static void statement_##x(){ \
+        if(afterComma() == TOKEN_register){ \
+            writeByte(OP_##x##r); \
+            reg(); \
+            consume(TOKEN_comma); \
+            reg(); \
+            return; \
+        } \
+        writeByte(OP_##x); \
+        reg(); \
+        consume(TOKEN_comma); \
+        imm(1); \
+    }
 
-static void statement_rshift(){
-    writeByte(OP_rshift);
-    reg();
-    consume(TOKEN_comma);
-    imm(1);
-}
+parseShift(lshift)
+
+parseShift(rshift)
 
 static void statement_load(){
+    if(match(TOKEN_lbracket)){
+        Address a;
+        address(&a);
+        writeByte(a.indexed ? OP_loadx : OP_loadr);
+        writeAddress(&a);
+        consume(TOKEN_comma);
+        reg();
+        return;
+    }
     writeByte(OP_load);
     ref();
     consume(TOKEN_comma);
@@ -319,6 +513,16 @@ static void statement_load(){
 }
 
 static void statement_store(){
+    if(afterComma() == TOKEN_lbracket){
+        uint8_t from = registerNumber();
+        consume(TOKEN_comma);
+        Address a;
+        address(&a);
+        writeByte(a.indexed ? OP_storex : OP_storer);
+        writeByte(from);
+        writeAddress(&a);
+        return;
+    }
     writeByte(OP_store);
     reg();
     consume(TOKEN_comma);
@@ -340,6 +544,13 @@ static void statement_save(){
 }
 
 static void statement_print(){
+    if(match(TOKEN_lbracket)){
+        Address a;
+        address(&a);
+        writeByte(a.indexed ? OP_printx : OP_printr);
+        writeAddress(&a);
+        return;
+    }
     writeByte(OP_print);
     ref();
 }
@@ -370,6 +581,15 @@ static void statement_jmp(){
 
 #define parseJump(x) \
     static void statement_##x(){ \
+        if(afterComma() == TOKEN_hash){ \
+            writeByte(OP_##x##i); \
+            reg(); \
+            consume(TOKEN_comma); \
+            imm(0); \
+            consume(TOKEN_comma); \
+            ref(); \
+            return; \
+        } \
         writeByte(OP_##x); \
         reg(); \
         consume(TOKEN_comma); \
@@ -386,9 +606,15 @@ parseJump(jgt)
 
 parseJump(jlt)
 
-parseJump(jov)
+#define parseStatusJump(x) \
+    static void statement_##x(){ \
+        writeByte(OP_##x); \
+        ref(); \
+    }
+
+parseStatusJump(jov)
 
-parseJump(jun)
+parseStatusJump(jun)
 
 #define parseNoop(x) \
         static void statement_##x(){ \
@@ -403,6 +629,56 @@ parseNoop(halt)
 
 parseNoop(nex)
 
+parseNoop(ret)
+
+static void statement_call(){
+    writeByte(OP_call);
+    ref();
+}
+
+// The indirect and immediate forms are picked by the
+// statements of the usual opcodes
+#define parseForm(x, y) \
+    static void statement_##x(){ \
+        statement_##y(); \
+    }
+
+parseForm(loadr, load)
+
+parseForm(loadx, load)
+
+parseForm(storer, store)
+
+parseForm(storex, store)
+
+parseForm(printr, print)
+
+parseForm(printx, print)
+
+parseForm(addi, add)
+
+parseForm(subi, sub)
+
+parseForm(muli, mul)
+
+parseForm(divi, div)
+
+parseForm(andi, and)
+
+parseForm(ori, or)
+
+parseForm(jeqi, jeq)
+
+parseForm(jnei, jne)
+
+parseForm(jgti, jgt)
+
+parseForm(jlti, jlt)
+
+parseForm(lshiftr, lshift)
+
+parseForm(rshiftr, rshift)
+
 static void statement_const(){
     imm(0);
 }
@@ -415,7 +691,10 @@ static void statement_label(){
     Token label = presentToken;
     advance();
     if(consume(TOKEN_colon)){
+        uint32_t errors = hasErrors;
         declareLabel(label, presentOffset);
+        if(sourceMap != NULL && errors == hasErrors)
+            sourcemap_add_label(sourceMap, presentOffset, label.string);
     }
 }
 
@@ -429,6 +708,30 @@ static void statement_decr(){
     reg();
 }
 
+static void statement_push(){
+    writeByte(OP_push);
+    reg();
+}
+
+static void statement_pop(){
+    writeByte(OP_pop);
+    reg();
+}
+
+static void statement_loop(){
+    writeByte(OP_loop);
+    reg();
+    consume(TOKEN_comma);
+    ref();
+}
+
+static void statement_djnz(){
+    writeByte(OP_djnz);
+    subreg(4);
+    consume(TOKEN_comma);
+    ref();
+}
+
 static void statement_prints(){
     writeByte(OP_prints);
     ref();
@@ -436,6 +739,154 @@ static void statement_prints(){
     imm(1);
 }
 
+static void statement_space(){
+    consume(TOKEN_hash);
+    if(consume(TOKEN_number)){
+        char *end;
+        int64_t num = strtoll(previousToken.string, &end, 10);
+        if(num < 0 || num > INT32_MAX || (uint64_t)num > UINT32_MAX - presentOffset){
+            err("Space must be " ANSI_FONT_BOLD "0" ANSI_COLOR_RESET " <= bytes <= " ANSI_FONT_BOLD
+                    "%" PRId32 ANSI_COLOR_RESET ", received " ANSI_FONT_BOLD ANSI_COLOR_MAGENTA "%s" ANSI_COLOR_RESET,
+                    INT32_MAX, previousToken.string);
+            token_print_source(previousToken, 1);
+            hasErrors++;
+        }
+        else
+            writeZeros(num);
+    }
+}
+
+static void statement_bcopy(){
+    writeByte(OP_bcopy);
+    ref();
+    consume(TOKEN_comma);
+    ref();
+    consume(TOKEN_comma);
+    reg();
+}
+
+static void statement_bfill(){
+    writeByte(OP_bfill);
+    reg();
+    consume(TOKEN_comma);
+    ref();
+    consume(TOKEN_comma);
+    reg();
+}
+
+static void statement_bcmp(){
+    writeByte(OP_bcmp);
+    ref();
+    consume(TOKEN_comma);
+    ref();
+    consume(TOKEN_comma);
+    reg();
+    consume(TOKEN_comma);
+    reg();
+}
+
+#define parseVector(x) \
+    static void statement_##x(){ \
+        writeByte(OP_##x); \
+        ref(); \
+        consume(TOKEN_comma); \
+        ref(); \
+        consume(TOKEN_comma); \
+        reg(); \
+    }
+
+parseVector(vadd)
+
+parseVector(vsub)
+
+parseVector(vmul)
+
+parseVector(vand)
+
+parseVector(vor)
+
+#define parseReduction(x) \
+    static void statement_##x(){ \
+        writeByte(OP_##x); \
+        ref(); \
+        consume(TOKEN_comma); \
+        reg(); \
+        consume(TOKEN_comma); \
+        reg(); \
+    }
+
+parseReduction(vsum)
+
+parseReduction(vmin)
+
+parseReduction(vmax)
+
+#define parseSubregister(x, lanes) \
+    static void statement_##x(){ \
+        writeByte(OP_##x); \
+        subreg(lanes); \
+        consume(TOKEN_comma); \
+        subreg(lanes); \
+    }
+
+parseSubregister(addb, 4)
+
+parseSubregister(addw, 2)
+
+parseSubregister(subb, 4)
+
+parseSubregister(subw, 2)
+
+parseSubregister(andb, 4)
+
+parseSubregister(andw, 2)
+
+parseSubregister(orb, 4)
+
+parseSubregister(orw, 2)
+
+static void statement_movb(){
+    writeByte(OP_movb);
+    narrowImm(1);
+    consume(TOKEN_comma);
+    subreg(4);
+}
+
+static void statement_movw(){
+    writeByte(OP_movw);
+    narrowImm(2);
+    consume(TOKEN_comma);
+    subreg(2);
+}
+
+static void statement_loadb(){
+    writeByte(OP_loadb);
+    ref();
+    consume(TOKEN_comma);
+    subreg(4);
+}
+
+static void statement_loadw(){
+    writeByte(OP_loadw);
+    ref();
+    consume(TOKEN_comma);
+    subreg(2);
+}
+
+static void statement_storeb(){
+    writeByte(OP_storeb);
+    subreg(4);
+    consume(TOKEN_comma);
+    ref();
+}
+
+static void statement_storew(){
+    writeByte(OP_storew);
+    subreg(2);
+    consume(TOKEN_comma);
+    ref();
+}
+
 #ifdef RM_ALLOW_PARSE_MESSAGES
 void statement_parseMessage(){
     printf("%s", presentToken.string);
@@ -444,9 +895,16 @@ void statement_parseMessage(){
 #endif
 
 bool parse_and_emit(TokenList l, uint8_t **mem, uint32_t *memS, uint32_t offset){
+    return parse_and_map(l, mem, memS, offset, NULL);
+}
+
+bool parse_and_map(TokenList l, uint8_t **mem, uint32_t *memS, uint32_t offset, SourceMap *map){
+    sourceMap = map;
     memory = *mem;
     memSize = *memS;
     presentOffset = offset;
+    present = 0;
+    hasErrors = 0;
     presentToken = l.tokens[0];
     presentLine = presentToken.line;
     list = l;
@@ -457,6 +915,8 @@ bool parse_and_emit(TokenList l, uint8_t **mem, uint32_t *memS, uint32_t offset)
         switch(presentToken.type){
 #define OPCODE(name, a, b) \
             case TOKEN_##name: \
+                               if(sourceMap != NULL) \
+                                   sourcemap_add_line(sourceMap, presentOffset, presentToken.line); \
                                consume(TOKEN_##name); \
             statement_##name(); \
             break;
@@ -485,6 +945,8 @@ bool parse_and_emit(TokenList l, uint8_t **mem, uint32_t *memS, uint32_t offset)
     }
     *mem = memory;
     *memS = memSize;
+    if(!hasErrors && !verify_program(memory, memSize))
+        hasErrors++;
     if(hasErrors){
         err("Compilation failed with " ANSI_FONT_BOLD  ANSI_COLOR_RED "%" PRIu32 ANSI_COLOR_RESET " errors!", hasErrors);
         return false;
@@ -1,7 +1,11 @@
 #pragma once
 #include "rm_common.h"
 #include "lexer.h"
+#include "sourcemap.h"
 #include <stdint.h>
 #include <stdbool.h>
 
 bool parse_and_emit(TokenList list, uint8_t **memory, uint32_t *memSize, uint32_t offset);
+// Like parse_and_emit, also recording the line of each statement
+// and the offset of each label in map, if it is not NULL
+bool parse_and_map(TokenList list, uint8_t **memory, uint32_t *memSize, uint32_t offset, SourceMap *map);
@@ -0,0 +1,130 @@
+#include "profile.h"
+#include "vm.h"
+#include "bytecode.h"
+#include "display.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+static const char* opStrings [] = {
+    #define OPCODE(name, a, b) #name,
+    #include "opcodes.h"
+    #undef OPCODE
+};
+
+Profile* profile_new(uint32_t memSize){
+    Profile *profile = (Profile *)malloc(sizeof(Profile));
+    if(profile == NULL)
+        return NULL;
+    for(uint32_t i = 0;i < PROFILE_OPCODES;i++)
+        profile->opcodes[i] = 0;
+    // Padded by one, so that an empty memory allocates too
+    profile->offsets = (uint64_t *)calloc((size_t)memSize + 1, sizeof(uint64_t));
+    profile->taken = (uint64_t *)calloc((size_t)memSize + 1, sizeof(uint64_t));
+    profile->size = memSize;
+    if(profile->offsets == NULL || profile->taken == NULL){
+        profile_free(profile);
+        return NULL;
+    }
+    return profile;
+}
+
+void profile_free(Profile *profile){
+    if(profile == NULL)
+        return;
+    free(profile->offsets);
+    free(profile->taken);
+    free(profile);
+}
+
+static const uint64_t *sortedCounts;
+
+// Hottest first, and in the order of the memory among equals
+static int hotter(const void *a, const void *b){
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    if(sortedCounts[x] != sortedCounts[y])
+        return sortedCounts[x] < sortedCounts[y] ? 1 : -1;
+    return x < y ? -1 : x > y;
+}
+
+static bool isConditional(uint8_t opcode){
+    return bc_is_conditional((Code)opcode);
+}
+
+void profile_print(const Profile *profile, const uint8_t *memory, const SourceMap *map, uint32_t top){
+    uint64_t total = 0;
+    uint32_t hot = 0;
+    for(uint32_t i = 0;i < profile->size;i++){
+        total += profile->offsets[i];
+        hot += profile->offsets[i] > 0;
+    }
+    if(total == 0){
+        warn("No instruction was executed!");
+        return;
+    }
+
+    uint32_t *order = (uint32_t *)malloc(sizeof(uint32_t) * (hot > PROFILE_OPCODES ? hot : PROFILE_OPCODES));
+    if(order == NULL){
+        err("Unable to allocate the profile report!");
+        return;
+    }
+
+    hot = 0;
+    for(uint32_t i = 0;i < profile->size;i++)
+        if(profile->offsets[i] > 0)
+            order[hot++] = i;
+    sortedCounts = profile->offsets;
+    qsort(order, hot, sizeof(uint32_t), hotter);
+
+    pblue(ANSI_FONT_BOLD "\nOffset\t");
+    pgrn(ANSI_FONT_BOLD "Opcode\t");
+    pylw(ANSI_FONT_BOLD "Executions\t     %%\t     Taken\t Not taken\t");
+    pcyn(ANSI_FONT_BOLD "Line\tLabel\n");
+    for(uint32_t i = 0;i < hot && i < top;i++){
+        uint32_t offset = order[i];
+        uint64_t count = profile->offsets[offset];
+        uint8_t opcode = memory[offset];
+        pblue("%04" PRIu32 "\t", offset);
+        pgrn("%6s\t", opcode < PROFILE_OPCODES ? opStrings[opcode] : "?");
+        pylw("%10" PRIu64 "\t%6.2f\t", count, 100.0 * count / total);
+        if(isConditional(opcode))
+            pylw("%10" PRIu64 "\t%10" PRIu64 "\t", profile->taken[offset], count - profile->taken[offset]);
+        else
+            printf("%10s\t%10s\t", "-", "-");
+        if(map == NULL){
+            printf("\n");
+            continue;
+        }
+        uint32_t line = sourcemap_line(map, offset), distance;
+        const SourceLabel *label = sourcemap_label(map, offset, &distance);
+        if(line > 0)
+            pcyn("%4" PRIu32 "\t", line);
+        else
+            printf("%4s\t", "-");
+        if(label == NULL)
+            printf("-\n");
+        else if(distance == 0)
+            pcyn("%s\n", label->name);
+        else
+            pcyn("%s + %" PRIu32 "\n", label->name, distance);
+    }
+    if(hot > top)
+        printf("... and %" PRIu32 " more offsets\n", hot - top);
+
+    hot = 0;
+    for(uint32_t i = 0;i < PROFILE_OPCODES;i++)
+        if(profile->opcodes[i] > 0)
+            order[hot++] = i;
+    sortedCounts = profile->opcodes;
+    qsort(order, hot, sizeof(uint32_t), hotter);
+
+    pgrn(ANSI_FONT_BOLD "\nOpcode\t");
+    pylw(ANSI_FONT_BOLD "Executions\t     %%\n");
+    for(uint32_t i = 0;i < hot;i++){
+        pgrn("%6s\t", opStrings[order[i]]);
+        pylw("%10" PRIu64 "\t%6.2f\n", profile->opcodes[order[i]], 100.0 * profile->opcodes[order[i]] / total);
+    }
+    pylw(ANSI_FONT_BOLD "%6s\t%10" PRIu64 "\n", "total", total);
+    free(order);
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include "rm_common.h"
+#include "sourcemap.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Profiles
+ * ========
+ *
+ * A machine which is profiled dispatches each decoded record to a
+ * counting variant of its handler first, which then goes on to the
+ * usual one. Superinstructions are not formed, and the JIT is left
+ * off, so that every instruction is counted at its own offset.
+ */
+
+enum{
+    #define OPCODE(name, a, b) PROFILE_##name,
+    #include "opcodes.h"
+    #undef OPCODE
+    PROFILE_OPCODES
+};
+
+typedef struct Profile{
+    uint64_t opcodes[PROFILE_OPCODES]; // executions of each opcode
+    uint64_t *offsets; // executions of the instruction at each offset
+    uint64_t *taken; // of those, the conditional jumps which jumped
+    uint32_t size;
+} Profile;
+
+Profile* profile_new(uint32_t memSize);
+void profile_free(Profile *profile);
+// Prints the top hottest offsets and the opcodes by executions.
+// Lines and labels are shown if map is not NULL.
+void profile_print(const Profile *profile, const uint8_t *memory, const SourceMap *map, uint32_t top);
@@ -5,7 +5,10 @@
 //
 // #define DEBUG
 
-// Turns on instruction stepping while execution
+// Turns on instruction stepping while execution,
+// by tracing each machine unless it asks for
+// another variant with rm_variant, and waiting
+// for a key after each traced instruction.
 //
 // #define DEBUG_INSTRUCTIONS
 
@@ -13,17 +16,40 @@
 // read and writes, by checking whether they are
 // out of bounds at each access explicitly.
 // Needless to say, this slows down the machine
-// to a large degree. Hence, it is defined here
-// as a switch between performance and security.
+// to a large degree. The operands of each
+// instruction are checked once by the verifier
+// when a program is loaded, and by the decoder
+// when patched code is decoded again, so this is
+// only needed to double check the machine itself.
+// It only picks the checked variant of the
+// interpreter for new machines, a machine can
+// ask for either with rm_variant.
 //
 // #define SANITIZE_ACCESS
 
+// This macro places the memory right before pages
+// which can not be accessed, so that any access
+// past the memory faults, and is reported by a
+// signal handler, without the machine checking
+// anything. Needs mmap, and a 64 bit address space
+// to cover the reach of the operands.
+//
+// #define GUARD_MEMORY
+
 // This macro switches between computed goto
 // and traditional switch case for instruction
 // dispatch. Generally, computed gotos are a lot 
 // faster.
 #define REAL_COMPUTED_GOTO
 
+// This macro makes each handler a function of its
+// own, which tail calls the next one, in place of
+// both of the above. Needs the musttail attribute,
+// or an optimized build, where gcc and clang turn
+// the calls into jumps anyway.
+//
+// #define REAL_TAIL_CALLS
+
 // To allow scan time messages in '()'
 #define RM_ALLOW_LEXER_MESSAGES
 // To allow parse time messages in '{}'
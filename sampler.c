@@ -0,0 +1,185 @@
+#include "sampler.h"
+#include "display.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <sys/time.h>
+
+Sampler* sampler_new(uint32_t memSize, uint32_t interval){
+    Sampler *sampler = (Sampler *)malloc(sizeof(Sampler));
+    if(sampler == NULL)
+        return NULL;
+    // Padded by one, so that an empty memory allocates too
+    sampler->samples = (uint64_t *)calloc((size_t)memSize + 1, sizeof(uint64_t));
+    sampler->size = memSize;
+    sampler->interval = interval;
+    sampler->total = 0;
+    if(sampler->samples == NULL){
+        free(sampler);
+        return NULL;
+    }
+    return sampler;
+}
+
+void sampler_free(Sampler *sampler){
+    if(sampler == NULL)
+        return;
+    free(sampler->samples);
+    free(sampler);
+}
+
+static VirtualMachine *sampled = NULL;
+static struct sigaction previous;
+
+static void tick(int sig){
+    (void)sig;
+    Sampler *sampler = sampled->sampler;
+    uint64_t pc = __atomic_load_n(&sampled->PC, __ATOMIC_RELAXED);
+    if(pc < sampler->size)
+        sampler->samples[pc]++;
+    sampler->total++;
+}
+
+bool sampler_start(VirtualMachine *machine){
+    if(sampled != NULL)
+        return false;
+    struct sigaction action;
+    action.sa_handler = tick;
+    sigemptyset(&action.sa_mask);
+    // Writes of the output are retried on EINTR, but the rest of
+    // the host need not be
+    action.sa_flags = SA_RESTART;
+    if(sigaction(SIGPROF, &action, &previous) != 0)
+        return false;
+    sampled = machine;
+    uint32_t interval = machine->sampler->interval;
+    struct itimerval timer = {{interval / 1000000, interval % 1000000}, {interval / 1000000, interval % 1000000}};
+    if(setitimer(ITIMER_PROF, &timer, NULL) != 0){
+        sigaction(SIGPROF, &previous, NULL);
+        sampled = NULL;
+        return false;
+    }
+    return true;
+}
+
+void sampler_stop(){
+    if(sampled == NULL)
+        return;
+    struct itimerval timer = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_PROF, &timer, NULL);
+    sigaction(SIGPROF, &previous, NULL);
+    sampled = NULL;
+}
+
+/* Reports
+ * =======
+ *
+ * Samples are added up per source line. The offsets of a line
+ * are next to each other, so consecutive sampled offsets which
+ * map to the same line make up one entry.
+ */
+
+typedef struct{
+    uint32_t offset; // first sampled offset of the line
+    uint32_t line; // zero without a map
+    uint64_t count;
+} Hotspot;
+
+static uint32_t aggregate(const Sampler *sampler, const SourceMap *map, Hotspot *spots){
+    uint32_t count = 0;
+    for(uint32_t i = 0;i < sampler->size;i++){
+        if(sampler->samples[i] == 0)
+            continue;
+        uint32_t line = map == NULL ? 0 : sourcemap_line(map, i);
+        if(count > 0 && line != 0 && spots[count - 1].line == line)
+            spots[count - 1].count += sampler->samples[i];
+        else
+            spots[count++] = (Hotspot){i, line, sampler->samples[i]};
+    }
+    return count;
+}
+
+// Most samples first, and in the order of the memory among equals
+static int hotter(const void *a, const void *b){
+    const Hotspot *x = (const Hotspot *)a, *y = (const Hotspot *)b;
+    if(x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static Hotspot* collect(const Sampler *sampler, const SourceMap *map, uint32_t *count){
+    uint32_t sampledOffsets = 0;
+    for(uint32_t i = 0;i < sampler->size;i++)
+        sampledOffsets += sampler->samples[i] > 0;
+    Hotspot *spots = (Hotspot *)malloc(sizeof(Hotspot) * (sampledOffsets + 1));
+    if(spots != NULL)
+        *count = aggregate(sampler, map, spots);
+    return spots;
+}
+
+void sampler_print(const Sampler *sampler, const SourceMap *map, uint32_t top){
+    if(sampler->total == 0){
+        warn("No sample was taken, the run was too short!");
+        return;
+    }
+    uint32_t count;
+    Hotspot *spots = collect(sampler, map, &count);
+    if(spots == NULL){
+        err("Unable to allocate the sample report!");
+        return;
+    }
+    qsort(spots, count, sizeof(Hotspot), hotter);
+
+    pylw(ANSI_FONT_BOLD "\nSamples\t     %%\t");
+    if(map != NULL)
+        pcyn(ANSI_FONT_BOLD "Line\tLabel\n");
+    else
+        pblue(ANSI_FONT_BOLD "Offset\n");
+    for(uint32_t i = 0;i < count && i < top;i++){
+        pylw("%7" PRIu64 "\t%6.2f\t", spots[i].count, 100.0 * spots[i].count / sampler->total);
+        if(map == NULL){
+            pblue("%04" PRIu32 "\n", spots[i].offset);
+            continue;
+        }
+        uint32_t distance;
+        const SourceLabel *label = sourcemap_label(map, spots[i].offset, &distance);
+        if(spots[i].line > 0)
+            pcyn("%4" PRIu32 "\t", spots[i].line);
+        else
+            printf("%4s\t", "-");
+        pcyn("%s\n", label == NULL ? "-" : label->name);
+    }
+    pylw(ANSI_FONT_BOLD "%7" PRIu64 "\tsamples, every %" PRIu32 " us\n", sampler->total, sampler->interval);
+    free(spots);
+}
+
+bool sampler_export(const Sampler *sampler, const SourceMap *map, const char *root, const char *fileName){
+    FILE *out = fopen(fileName, "w");
+    if(out == NULL){
+        err("Unable to open file for saving : " ANSI_COLOR_RED ANSI_FONT_BOLD "%s" ANSI_COLOR_RESET " !\n", fileName);
+        return false;
+    }
+    uint32_t count;
+    Hotspot *spots = collect(sampler, map, &count);
+    if(spots == NULL){
+        fclose(out);
+        return false;
+    }
+    for(uint32_t i = 0;i < count;i++){
+        uint32_t distance;
+        const SourceLabel *label = map == NULL ? NULL : sourcemap_label(map, spots[i].offset, &distance);
+        fprintf(out, "%s;", root);
+        if(label != NULL)
+            fprintf(out, "%s;", label->name);
+        if(spots[i].line > 0)
+            fprintf(out, "line %" PRIu32, spots[i].line);
+        else
+            fprintf(out, "@%04" PRIu32, spots[i].offset);
+        fprintf(out, " %" PRIu64 "\n", spots[i].count);
+    }
+    free(spots);
+    bool written = !ferror(out);
+    return fclose(out) == 0 && written;
+}
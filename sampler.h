@@ -0,0 +1,35 @@
+#pragma once
+#include "rm_common.h"
+#include "vm.h"
+#include "sourcemap.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Sampling profiler
+ * =================
+ *
+ * A sampled machine stores its PC in the VirtualMachine before
+ * each instruction, which is all it pays, and a SIGPROF timer
+ * counts the offset it finds there at each tick of CPU time
+ * while rm_run executes. Like profiles, sampled machines do not
+ * form superinstructions or use the JIT. Only one machine can be
+ * sampled at a time.
+ */
+
+typedef struct Sampler{
+    uint64_t *samples; // ticks which found the PC at each offset
+    uint32_t size;
+    uint32_t interval; // microseconds of CPU time between ticks
+    uint64_t total;
+} Sampler;
+
+Sampler* sampler_new(uint32_t memSize, uint32_t interval);
+void sampler_free(Sampler *sampler);
+// Arms and disarms the timer for the machine, around a run
+bool sampler_start(VirtualMachine *machine);
+void sampler_stop();
+// Prints the top lines by samples, or offsets if map is NULL
+void sampler_print(const Sampler *sampler, const SourceMap *map, uint32_t top);
+// Writes the samples as folded stacks, one 'root;label;line count'
+// per line, for flame graph tools
+bool sampler_export(const Sampler *sampler, const SourceMap *map, const char *root, const char *fileName);
@@ -0,0 +1,226 @@
+// For memfd_create
+#define _GNU_SOURCE
+#include "snapshot.h"
+#include "display.h"
+#include "guard.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Snapshots
+ * =========
+ *
+ * A snapshot keeps the memory of a machine in an anonymous file,
+ * laid out as guard.c lays out the memory, at the end of its pages.
+ * Each spawned machine maps the file privately, so it shares the
+ * pages of the snapshot until it writes to them, and the kernel
+ * copies only those.
+ *
+ * Spawned machines track the chunks they write in dirty, from the
+ * slow path of the stores, so that rm_reset copies back only those.
+ * It drops the decoded records only where the bytes it copies back
+ * differ, so the rest of the instruction cache, and the native
+ * code, stay warm across resets.
+ */
+
+struct Snapshot{
+    int fd; // file holding the pages of the memory
+    const uint8_t *image; // shared view of it, for rm_reset
+    size_t size; // bytes of the pages
+    uint32_t memSize;
+    int32_t registers[8];
+    uint64_t PC;
+    uint8_t SR;
+    uint32_t stackSize; // zero if the machine had no stack yet
+    uint32_t depth; // longs on the stack, copied to stack
+    uint32_t *stack;
+};
+
+// Puts the longs of the snapshot back on the top of the stack
+static void restoreStack(VirtualMachine *machine, const Snapshot *snapshot){
+    machine->SP = machine->stackSize - snapshot->depth;
+    if(snapshot->depth > 0)
+        memcpy(&machine->stack[machine->SP], snapshot->stack, sizeof(uint32_t) * snapshot->depth);
+}
+
+#ifdef __linux__
+
+static size_t pagesFor(uint32_t memSize){
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = ((size_t)memSize + page - 1) / page * page;
+    return size > 0 ? size : page;
+}
+
+Snapshot* rm_snapshot(VirtualMachine *machine){
+    Snapshot *snapshot = (Snapshot *)malloc(sizeof(Snapshot));
+    if(snapshot == NULL)
+        return NULL;
+    snapshot->size = pagesFor(machine->memSize);
+    snapshot->fd = memfd_create("realmachine", MFD_CLOEXEC);
+    if(snapshot->fd < 0 || ftruncate(snapshot->fd, snapshot->size) != 0){
+        err("Unable to create the snapshot!");
+        if(snapshot->fd >= 0)
+            close(snapshot->fd);
+        free(snapshot);
+        return NULL;
+    }
+    uint8_t *image = (uint8_t *)mmap(NULL, snapshot->size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, snapshot->fd, 0);
+    if(image == MAP_FAILED){
+        err("Unable to map the snapshot!");
+        close(snapshot->fd);
+        free(snapshot);
+        return NULL;
+    }
+    snapshot->stackSize = machine->stackSize;
+    snapshot->depth = machine->stackSize - machine->SP;
+    snapshot->stack = NULL;
+    if(snapshot->depth > 0){
+        snapshot->stack = (uint32_t *)malloc(sizeof(uint32_t) * snapshot->depth);
+        if(snapshot->stack == NULL){
+            err("Unable to create the snapshot!");
+            munmap(image, snapshot->size);
+            close(snapshot->fd);
+            free(snapshot);
+            return NULL;
+        }
+        memcpy(snapshot->stack, &machine->stack[machine->SP], sizeof(uint32_t) * snapshot->depth);
+    }
+
+    memcpy(image + snapshot->size - machine->memSize, machine->memory, machine->memSize);
+    // Only read from now on
+    mprotect(image, snapshot->size, PROT_READ);
+
+    snapshot->image = image;
+    snapshot->memSize = machine->memSize;
+    memcpy(snapshot->registers, machine->registers, sizeof(snapshot->registers));
+    snapshot->PC = machine->PC;
+    snapshot->SR = rm_status(machine);
+    return snapshot;
+}
+
+VirtualMachine* rm_spawn(Snapshot *snapshot){
+    size_t reach = snapshot->size;
+#ifdef GUARD_MEMORY
+    reach += guard_size();
+#endif
+    // Reserve the guard along, then put the pages of the file in front
+    uint8_t *mapping = (uint8_t *)mmap(NULL, reach, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(mapping == MAP_FAILED)
+        return NULL;
+    if(mmap(mapping, snapshot->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                snapshot->fd, 0) == MAP_FAILED){
+        munmap(mapping, reach);
+        return NULL;
+    }
+
+    uint32_t chunks = (snapshot->memSize >> DIRTY_SHIFT) + 1;
+    VirtualMachine *machine = rm_new();
+    machine->dirty = (uint8_t *)calloc(chunks, sizeof(uint8_t));
+    machine->dirtyChunks = (uint32_t *)malloc(sizeof(uint32_t) * chunks);
+    machine->mapping = mapping;
+    machine->mappingSize = reach;
+    machine->memory = mapping + snapshot->size - snapshot->memSize;
+    if(machine->dirty == NULL || machine->dirtyChunks == NULL){
+        rm_free(machine);
+        return NULL;
+    }
+#ifdef GUARD_MEMORY
+    machine->guarded = guard_size() > 0;
+#endif
+    machine->memSize = snapshot->memSize;
+    machine->snapshot = snapshot;
+    memcpy(machine->registers, snapshot->registers, sizeof(machine->registers));
+    machine->PC = snapshot->PC;
+    machine->SR = snapshot->SR;
+    // Otherwise the stack is allocated when the machine first runs
+    if(snapshot->stackSize > 0){
+        if(!rm_stack(machine, snapshot->stackSize)){
+            rm_free(machine);
+            return NULL;
+        }
+        restoreStack(machine, snapshot);
+    }
+    return machine;
+}
+
+void rm_snapshot_free(Snapshot *snapshot){
+    munmap((void *)snapshot->image, snapshot->size);
+    close(snapshot->fd);
+    free(snapshot->stack);
+    free(snapshot);
+}
+
+#else
+
+Snapshot* rm_snapshot(VirtualMachine *machine){
+    (void)machine;
+    return NULL;
+}
+
+VirtualMachine* rm_spawn(Snapshot *snapshot){
+    (void)snapshot;
+    return NULL;
+}
+
+void rm_snapshot_free(Snapshot *snapshot){
+    (void)snapshot;
+}
+
+#endif
+
+void rm_dirty(VirtualMachine *machine, uint32_t offset, uint32_t bytes){
+    if(bytes == 0 || offset >= machine->memSize)
+        return;
+    uint32_t last = bytes - 1 < machine->memSize - offset ? offset + bytes - 1 : machine->memSize - 1;
+    for(uint32_t chunk = offset >> DIRTY_SHIFT;chunk <= last >> DIRTY_SHIFT;chunk++){
+        if(!machine->dirty[chunk]){
+            machine->dirty[chunk] = 1;
+            machine->dirtyChunks[machine->dirtyCount++] = chunk;
+        }
+    }
+}
+
+// Copies a chunk back from the image. The records decoded from the
+// bytes which differ are dropped, the rest of the chunk may be code
+// which is still valid.
+static void restore(VirtualMachine *machine, const uint8_t *image, uint32_t from, uint32_t bytes){
+    uint8_t *memory = machine->memory;
+    if(memcmp(memory + from, image + from, bytes) == 0)
+        return;
+    if(machine->code != NULL){
+        for(uint32_t i = from;i < from + bytes;i++){
+            if(memory[i] != image[i] && machine->codeMap[i])
+                rm_invalidate(machine, i, 1);
+        }
+    }
+    memcpy(memory + from, image + from, bytes);
+}
+
+bool rm_reset(VirtualMachine *machine){
+    Snapshot *snapshot = machine->snapshot;
+    if(snapshot == NULL)
+        return false;
+    const uint8_t *image = snapshot->image + snapshot->size - snapshot->memSize;
+    for(uint32_t i = 0;i < machine->dirtyCount;i++){
+        uint32_t from = machine->dirtyChunks[i] << DIRTY_SHIFT;
+        uint32_t bytes = machine->memSize - from;
+        if(bytes > (1u << DIRTY_SHIFT))
+            bytes = 1u << DIRTY_SHIFT;
+        restore(machine, image, from, bytes);
+        machine->dirty[machine->dirtyChunks[i]] = 0;
+    }
+    machine->dirtyCount = 0;
+
+    memcpy(machine->registers, snapshot->registers, sizeof(machine->registers));
+    machine->PC = snapshot->PC;
+    machine->SR = snapshot->SR;
+    restoreStack(machine, snapshot);
+    machine->flagOp = FLAGS_SETTLED;
+    machine->retired = 0;
+    output_flush(&machine->output);
+    return true;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include "rm_common.h"
+#include "vm.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Granularity at which spawned machines track their writes
+#define DIRTY_SHIFT 12
+
+typedef struct Snapshot Snapshot;
+
+// Captures the memory, the registers, PC, SR and the stack of a machine
+// which is not running. NULL if the host has no snapshots.
+Snapshot* rm_snapshot(VirtualMachine *machine);
+// A new machine in the state of the snapshot, sharing its pages
+// until it writes to them
+VirtualMachine* rm_spawn(Snapshot *snapshot);
+// Puts a spawned machine back in the state of its snapshot
+bool rm_reset(VirtualMachine *machine);
+// The snapshot must outlive the machines spawned from it
+void rm_snapshot_free(Snapshot *snapshot);
+
+// Slow path of a write to a clean chunk of a spawned machine
+void rm_dirty(VirtualMachine *machine, uint32_t offset, uint32_t bytes);
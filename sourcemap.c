@@ -0,0 +1,84 @@
+#include "sourcemap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void sourcemap_init(SourceMap *map){
+    map->lines = NULL;
+    map->lineCount = map->lineCapacity = 0;
+    map->labels = NULL;
+    map->labelCount = map->labelCapacity = 0;
+}
+
+void sourcemap_free(SourceMap *map){
+    for(uint32_t i = 0;i < map->labelCount;i++)
+        free(map->labels[i].name);
+    free(map->lines);
+    free(map->labels);
+    sourcemap_init(map);
+}
+
+// Grows an array of entries to hold one more
+static bool reserve(void **entries, uint32_t count, uint32_t *capacity, size_t size){
+    if(count < *capacity)
+        return true;
+    uint32_t grown = *capacity == 0 ? 64 : *capacity * 2;
+    void *moved = realloc(*entries, size * grown);
+    if(moved == NULL)
+        return false;
+    *entries = moved;
+    *capacity = grown;
+    return true;
+}
+
+bool sourcemap_add_line(SourceMap *map, uint32_t offset, uint32_t line){
+    // A statement which emits nothing shares its offset with the next
+    if(map->lineCount > 0 && map->lines[map->lineCount - 1].offset == offset){
+        map->lines[map->lineCount - 1].line = line;
+        return true;
+    }
+    if(!reserve((void **)&map->lines, map->lineCount, &map->lineCapacity, sizeof(SourceLine)))
+        return false;
+    map->lines[map->lineCount++] = (SourceLine){offset, line};
+    return true;
+}
+
+bool sourcemap_add_label(SourceMap *map, uint32_t offset, const char *name){
+    if(!reserve((void **)&map->labels, map->labelCount, &map->labelCapacity, sizeof(SourceLabel)))
+        return false;
+    char *copy = (char *)malloc(strlen(name) + 1);
+    if(copy == NULL)
+        return false;
+    strcpy(copy, name);
+    map->labels[map->labelCount++] = (SourceLabel){offset, copy};
+    return true;
+}
+
+// Index of the last entry at or before offset, count if none.
+// Both kinds of entries start with their offset.
+#define LAST_AT_OR_BEFORE(entries, count, offset, result) { \
+        uint32_t low = 0, high = count; \
+        while(low < high){ \
+            uint32_t mid = low + (high - low) / 2; \
+            if(entries[mid].offset <= offset) \
+                low = mid + 1; \
+            else \
+                high = mid; \
+        } \
+        result = low == 0 ? count : low - 1; \
+    }
+
+uint32_t sourcemap_line(const SourceMap *map, uint32_t offset){
+    uint32_t at;
+    LAST_AT_OR_BEFORE(map->lines, map->lineCount, offset, at);
+    return at == map->lineCount ? 0 : map->lines[at].line;
+}
+
+const SourceLabel* sourcemap_label(const SourceMap *map, uint32_t offset, uint32_t *distance){
+    uint32_t at;
+    LAST_AT_OR_BEFORE(map->labels, map->labelCount, offset, at);
+    if(at == map->labelCount)
+        return NULL;
+    *distance = offset - map->labels[at].offset;
+    return &map->labels[at];
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include "rm_common.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Source maps
+ * ===========
+ *
+ * Maps offsets of the memory back to the source the parser read
+ * them from. Each statement adds the offset it starts at along
+ * with its line, and each label its offset, both in the order
+ * they appear, so that an offset is looked up by a binary search
+ * for the last entry at or before it.
+ */
+
+typedef struct{
+    uint32_t offset;
+    uint32_t line;
+} SourceLine;
+
+typedef struct{
+    uint32_t offset;
+    char *name;
+} SourceLabel;
+
+typedef struct{
+    SourceLine *lines;
+    uint32_t lineCount, lineCapacity;
+    SourceLabel *labels;
+    uint32_t labelCount, labelCapacity;
+} SourceMap;
+
+void sourcemap_init(SourceMap *map);
+void sourcemap_free(SourceMap *map);
+bool sourcemap_add_line(SourceMap *map, uint32_t offset, uint32_t line);
+bool sourcemap_add_label(SourceMap *map, uint32_t offset, const char *name);
+// Line of the statement covering offset, zero if unknown
+uint32_t sourcemap_line(const SourceMap *map, uint32_t offset);
+// Closest label at or before offset, and how far before it is.
+// NULL if there is none.
+const SourceLabel* sourcemap_label(const SourceMap *map, uint32_t offset, uint32_t *distance);
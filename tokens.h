@@ -31,6 +31,21 @@ ET(label)
 // :
 ET(colon)
 
+// .
+ET(dot)
+
+// [ which starts an address, not a comment
+ET(lbracket)
+
+// ]
+ET(rbracket)
+
+// +
+ET(plus)
+
+// *
+ET(star)
+
 // any consecutive sequence of characters
 ET(string)
 
@@ -0,0 +1,255 @@
+#include "vector.h"
+
+#include <pthread.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define VECTOR_X86
+#include <immintrin.h>
+#endif
+
+/* Vector kernels
+ * ==============
+ *
+ * The vector opcodes work on runs of longs, which are big endian
+ * in the memory, like the operands of load and store. The kernels
+ * swap them to host order in registers, do the arithmetic, and
+ * swap the results back, while and and or work on the bytes as
+ * they are. The scalar kernels define the results. The SSE2 ones
+ * run on every x86-64 host, and the AVX2 ones where CPUID has it,
+ * picked the first time a vector opcode runs.
+ *
+ * Each kernel does as many longs as fit in its registers at a
+ * time, and leaves the rest to the scalar one. A destination
+ * which starts inside its source, after it, would read longs
+ * which the scalar kernel writes first, so those runs are left to
+ * the scalar kernels, and every host gets the same results.
+ */
+
+typedef void (*ApplyKernel)(uint8_t *dst, const uint8_t *src, uint32_t count);
+typedef int32_t (*ReduceKernel)(const uint8_t *src, uint32_t count);
+
+typedef struct{
+    const char *name;
+    ApplyKernel apply[VECTOR_OR + 1];
+    ReduceKernel reduce[VECTOR_MAX + 1];
+} Kernels;
+
+static uint32_t get(const uint8_t *p){
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put(uint8_t *p, uint32_t val){
+    p[0] = val >> 24;
+    p[1] = val >> 16;
+    p[2] = val >> 8;
+    p[3] = val;
+}
+
+static int32_t add32(int32_t a, int32_t b){
+    return (int32_t)((uint32_t)a + (uint32_t)b);
+}
+
+static int32_t min32(int32_t a, int32_t b){
+    return a < b ? a : b;
+}
+
+static int32_t max32(int32_t a, int32_t b){
+    return a > b ? a : b;
+}
+
+#define KEEP(x) (x)
+
+/* Scalar kernels
+ * ==============
+ */
+
+#define SCALAR_APPLY(name, expr) \
+    static void scalar_##name(uint8_t *dst, const uint8_t *src, uint32_t count){ \
+        for(uint32_t i = 0;i < count;i++){ \
+            uint32_t a = get(&src[4 * i]), b = get(&dst[4 * i]); \
+            put(&dst[4 * i], expr); \
+        } \
+    }
+
+#define SCALAR_REDUCE(name, init, combine) \
+    static int32_t scalar_##name(const uint8_t *src, uint32_t count){ \
+        int32_t result = init; \
+        for(uint32_t i = 0;i < count;i++) \
+            result = combine(result, (int32_t)get(&src[4 * i])); \
+        return result; \
+    }
+
+SCALAR_APPLY(add, a + b)
+SCALAR_APPLY(sub, a - b)
+SCALAR_APPLY(mul, a * b)
+SCALAR_APPLY(and, a & b)
+SCALAR_APPLY(or, a | b)
+
+SCALAR_REDUCE(sum, 0, add32)
+SCALAR_REDUCE(min, INT32_MAX, min32)
+SCALAR_REDUCE(max, INT32_MIN, max32)
+
+static const Kernels scalar = {
+    "scalar",
+    {scalar_add, scalar_sub, scalar_mul, scalar_and, scalar_or},
+    {scalar_sum, scalar_min, scalar_max}
+};
+
+static const Kernels *kernels = &scalar;
+
+#ifdef VECTOR_X86
+
+/* SSE2 kernels
+ * ============
+ */
+
+// Swaps the bytes of each long
+static inline __m128i sse2_swap(__m128i x){
+    x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+    x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+// SSE2 has no 32 bit multiply, min or max of its own
+static inline __m128i mul4(__m128i a, __m128i b){
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static inline __m128i min4(__m128i a, __m128i b){
+    __m128i greater = _mm_cmpgt_epi32(a, b);
+    return _mm_or_si128(_mm_and_si128(greater, b), _mm_andnot_si128(greater, a));
+}
+
+static inline __m128i max4(__m128i a, __m128i b){
+    __m128i greater = _mm_cmpgt_epi32(a, b);
+    return _mm_or_si128(_mm_and_si128(greater, a), _mm_andnot_si128(greater, b));
+}
+
+#define SSE2_APPLY(name, swap, expr) \
+    static void sse2_##name(uint8_t *dst, const uint8_t *src, uint32_t count){ \
+        uint32_t i = 0; \
+        for(;count - i >= 4;i += 4){ \
+            __m128i a = swap(_mm_loadu_si128((const __m128i *)&src[4 * i])); \
+            __m128i b = swap(_mm_loadu_si128((const __m128i *)&dst[4 * i])); \
+            _mm_storeu_si128((__m128i *)&dst[4 * i], swap(expr)); \
+        } \
+        scalar_##name(&dst[4 * i], &src[4 * i], count - i); \
+    }
+
+#define SSE2_REDUCE(name, init, step, combine) \
+    static int32_t sse2_##name(const uint8_t *src, uint32_t count){ \
+        __m128i acc = _mm_set1_epi32(init); \
+        uint32_t i = 0; \
+        for(;count - i >= 4;i += 4) \
+            acc = step(acc, sse2_swap(_mm_loadu_si128((const __m128i *)&src[4 * i]))); \
+        int32_t lanes[4]; \
+        _mm_storeu_si128((__m128i *)lanes, acc); \
+        int32_t result = scalar_##name(&src[4 * i], count - i); \
+        for(uint8_t j = 0;j < 4;j++) \
+            result = combine(result, lanes[j]); \
+        return result; \
+    }
+
+SSE2_APPLY(add, sse2_swap, _mm_add_epi32(a, b))
+SSE2_APPLY(sub, sse2_swap, _mm_sub_epi32(a, b))
+SSE2_APPLY(mul, sse2_swap, mul4(a, b))
+SSE2_APPLY(and, KEEP, _mm_and_si128(a, b))
+SSE2_APPLY(or, KEEP, _mm_or_si128(a, b))
+
+SSE2_REDUCE(sum, 0, _mm_add_epi32, add32)
+SSE2_REDUCE(min, INT32_MAX, min4, min32)
+SSE2_REDUCE(max, INT32_MIN, max4, max32)
+
+static const Kernels sse2 = {
+    "sse2",
+    {sse2_add, sse2_sub, sse2_mul, sse2_and, sse2_or},
+    {sse2_sum, sse2_min, sse2_max}
+};
+
+/* AVX2 kernels
+ * ============
+ *
+ * Built for AVX2 function by function, so that the rest of the
+ * VM runs on hosts without it.
+ */
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i avx2_swap(__m256i x){
+    const __m256i order = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    return _mm256_shuffle_epi8(x, order);
+}
+
+#define AVX2_APPLY(name, swap, expr) \
+    AVX2 static void avx2_##name(uint8_t *dst, const uint8_t *src, uint32_t count){ \
+        uint32_t i = 0; \
+        for(;count - i >= 8;i += 8){ \
+            __m256i a = swap(_mm256_loadu_si256((const __m256i *)&src[4 * i])); \
+            __m256i b = swap(_mm256_loadu_si256((const __m256i *)&dst[4 * i])); \
+            _mm256_storeu_si256((__m256i *)&dst[4 * i], swap(expr)); \
+        } \
+        scalar_##name(&dst[4 * i], &src[4 * i], count - i); \
+    }
+
+#define AVX2_REDUCE(name, init, step, combine) \
+    AVX2 static int32_t avx2_##name(const uint8_t *src, uint32_t count){ \
+        __m256i acc = _mm256_set1_epi32(init); \
+        uint32_t i = 0; \
+        for(;count - i >= 8;i += 8) \
+            acc = step(acc, avx2_swap(_mm256_loadu_si256((const __m256i *)&src[4 * i]))); \
+        int32_t lanes[8]; \
+        _mm256_storeu_si256((__m256i *)lanes, acc); \
+        int32_t result = scalar_##name(&src[4 * i], count - i); \
+        for(uint8_t j = 0;j < 8;j++) \
+            result = combine(result, lanes[j]); \
+        return result; \
+    }
+
+AVX2_APPLY(add, avx2_swap, _mm256_add_epi32(a, b))
+AVX2_APPLY(sub, avx2_swap, _mm256_sub_epi32(a, b))
+AVX2_APPLY(mul, avx2_swap, _mm256_mullo_epi32(a, b))
+AVX2_APPLY(and, KEEP, _mm256_and_si256(a, b))
+AVX2_APPLY(or, KEEP, _mm256_or_si256(a, b))
+
+AVX2_REDUCE(sum, 0, _mm256_add_epi32, add32)
+AVX2_REDUCE(min, INT32_MAX, _mm256_min_epi32, min32)
+AVX2_REDUCE(max, INT32_MIN, _mm256_max_epi32, max32)
+
+static const Kernels avx2 = {
+    "avx2",
+    {avx2_add, avx2_sub, avx2_mul, avx2_and, avx2_or},
+    {avx2_sum, avx2_min, avx2_max}
+};
+
+#endif
+
+static pthread_once_t picked = PTHREAD_ONCE_INIT;
+
+static void pick(){
+#ifdef VECTOR_X86
+    __builtin_cpu_init();
+    kernels = __builtin_cpu_supports("avx2") ? &avx2 : &sse2;
+#endif
+}
+
+void vector_apply(VectorOp op, uint8_t *dst, const uint8_t *src, uint32_t count){
+    pthread_once(&picked, pick);
+    if(dst > src && dst < src + (size_t)count * 4)
+        scalar.apply[op](dst, src, count);
+    else
+        kernels->apply[op](dst, src, count);
+}
+
+int32_t vector_reduce(VectorReduction op, const uint8_t *src, uint32_t count){
+    pthread_once(&picked, pick);
+    return kernels->reduce[op](src, count);
+}
+
+const char* vector_kernels(){
+    pthread_once(&picked, pick);
+    return kernels->name;
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "rm_common.h"
+#include <stdint.h>
+
+// Element-wise operations, dst[i] = src[i] op dst[i]
+typedef enum{
+    VECTOR_ADD,
+    VECTOR_SUB,
+    VECTOR_MUL,
+    VECTOR_AND,
+    VECTOR_OR
+} VectorOp;
+
+// Reductions of a run of longs to one
+typedef enum{
+    VECTOR_SUM,
+    VECTOR_MIN,
+    VECTOR_MAX
+} VectorReduction;
+
+// Applies op to count big endian longs at src and dst, storing
+// the results at dst
+void vector_apply(VectorOp op, uint8_t *dst, const uint8_t *src, uint32_t count);
+// Reduces count big endian longs at src. The sum wraps around,
+// min and max are signed, and an empty run gives INT32_MAX and
+// INT32_MIN to them respectively.
+int32_t vector_reduce(VectorReduction op, const uint8_t *src, uint32_t count);
+// Name of the kernels picked for the host
+const char* vector_kernels();
@@ -0,0 +1,206 @@
+#include "verifier.h"
+#include "display.h"
+
+#include <stdlib.h>
+#include <inttypes.h>
+
+/* Bytecode verifier
+ * =================
+ *
+ * Runs once a program is compiled or read from the disk, and
+ * follows every path from offset 0, without running anything.
+ * A program passes if each instruction it can reach decodes,
+ * its direct memory operands lie inside the memory, its jumps
+ * land inside the memory, and no instruction starts in the
+ * middle of another one. It must not reach non-executable code,
+ * or run past the end of the memory either.
+ *
+ * The decoder does the same operand checks for each record, so
+ * code which is patched at runtime is checked when it is decoded
+ * again. Together, they let the interpreter access the memory
+ * without checking each access.
+ */
+
+// Whether [address, address + bytes) lies in the memory
+static bool inside(uint32_t address, uint32_t bytes, uint32_t memSize){
+    return address <= memSize && bytes <= memSize - address;
+}
+
+bool verify_access(const Operation *op, uint32_t memSize, uint32_t *address, bool *write){
+    uint32_t read = 0, readBytes = 0, written = 0, writtenBytes = 0;
+    switch(op->opcode){
+        case OP_load:
+        case OP_print:
+            read = op->val[0];
+            readBytes = 4;
+            break;
+        case OP_printc:
+        case OP_loadb:
+            read = op->val[0];
+            readBytes = 1;
+            break;
+        case OP_loadw:
+            read = op->val[0];
+            readBytes = 2;
+            break;
+        case OP_prints:
+            read = op->val[0];
+            readBytes = op->val[1];
+            break;
+        case OP_store:
+            written = op->val[0];
+            writtenBytes = 4;
+            break;
+        case OP_storeb:
+            written = op->val[0];
+            writtenBytes = 1;
+            break;
+        case OP_storew:
+            written = op->val[0];
+            writtenBytes = 2;
+            break;
+        case OP_save:
+            written = op->val[1];
+            writtenBytes = 4;
+            break;
+        case OP_mcopy:
+            read = op->val[0];
+            readBytes = 4;
+            written = op->val[1];
+            writtenBytes = 4;
+            break;
+        default:
+            return true;
+    }
+    if(readBytes && !inside(read, readBytes, memSize)){
+        // Report the first byte which is out
+        *address = read < memSize ? memSize : read;
+        *write = false;
+        return false;
+    }
+    if(writtenBytes && !inside(written, writtenBytes, memSize)){
+        *address = written < memSize ? memSize : written;
+        *write = true;
+        return false;
+    }
+    return true;
+}
+
+// Marks of each byte while the program is walked
+enum{
+    UNSEEN,
+    START, // an instruction starts here
+    BODY // operands of an instruction
+};
+
+static bool reject(uint32_t offset, const char *reason){
+    err("Verification failed at offset " ANSI_FONT_BOLD ANSI_COLOR_RED "%04" PRIu32 ANSI_COLOR_RESET
+            " : %s!", offset, reason);
+    return false;
+}
+
+bool verify_program(const uint8_t *memory, uint32_t memSize){
+    if(memSize == 0)
+        return true;
+
+    uint8_t *marks = (uint8_t *)calloc(memSize, sizeof(uint8_t));
+    uint32_t *pending = (uint32_t *)malloc(sizeof(uint32_t) * memSize);
+    if(marks == NULL || pending == NULL){
+        free(marks);
+        free(pending);
+        err("Unable to allocate the verifier!");
+        return false;
+    }
+
+    bool ret = true;
+    uint32_t count = 0;
+    pending[count++] = 0;
+    while(ret && count > 0){
+        uint32_t offset = pending[--count];
+        // Walk a straight run until it jumps away, or reaches code
+        // which is already checked
+        while(ret){
+            if(offset >= memSize){
+                ret = reject(offset, "execution runs past the end of the memory");
+                break;
+            }
+            if(marks[offset] == START)
+                break;
+            if(marks[offset] == BODY){
+                ret = reject(offset, "execution reaches the middle of an instruction");
+                break;
+            }
+
+            Operation op;
+            if(!bc_decode_op(memory, offset, memSize, &op) || op.opcode == OP_nex){
+                ret = reject(offset, "execution reaches non-executable code");
+                break;
+            }
+            uint32_t address;
+            bool write;
+            if(!verify_access(&op, memSize, &address, &write)){
+                err("Verification failed at offset " ANSI_FONT_BOLD ANSI_COLOR_RED "%04" PRIu32 ANSI_COLOR_RESET
+                        " : %s unmapped memory at offset " ANSI_FONT_BOLD ANSI_COLOR_RED "%04" PRIu32
+                        ANSI_COLOR_RESET "!", offset, write ? "writes to" : "reads from", address);
+                ret = false;
+                break;
+            }
+
+            marks[offset] = START;
+            for(uint32_t i = 1;i < op.length;i++){
+                if(marks[offset + i] == START){
+                    ret = reject(offset + i, "an instruction starts in the middle of another one");
+                    break;
+                }
+                marks[offset + i] = BODY;
+            }
+
+            bool ends = false;
+            switch(op.opcode){
+                case OP_jeq:
+                case OP_jne:
+                case OP_jgt:
+                case OP_jlt:
+                case OP_jeqi:
+                case OP_jnei:
+                case OP_jgti:
+                case OP_jlti:
+                case OP_jov:
+                case OP_jun:
+                case OP_loop:
+                case OP_djnz:
+                case OP_call:
+                    // Each instruction is walked once, and pushes one
+                    // target at most, so pending can not overflow
+                    if(op.val[0] >= memSize)
+                        ret = reject(offset, "jump target lies outside the memory");
+                    else if(marks[op.val[0]] != START)
+                        pending[count++] = op.val[0];
+                    break;
+                case OP_jmp:
+                    if(op.val[0] >= memSize)
+                        ret = reject(offset, "jump target lies outside the memory");
+                    offset = op.val[0];
+                    continue;
+                case OP_clrpc:
+                    offset = 0;
+                    continue;
+                case OP_halt:
+                case OP_ret:
+                    // Returns land after a call, which is walked
+                    // past the call itself
+                    ends = true;
+                    break;
+                default:
+                    break;
+            }
+            if(ends)
+                break;
+            offset += op.length;
+        }
+    }
+
+    free(marks);
+    free(pending);
+    return ret;
+}
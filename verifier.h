@@ -0,0 +1,14 @@
+#pragma once
+#include "rm_common.h"
+#include "bytecode.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Whether the memory operands of op lie inside the memory. If
+// not, the offset of the bad access is stored in address, and
+// whether it was a write in write.
+bool verify_access(const Operation *op, uint32_t memSize, uint32_t *address, bool *write);
+
+// Checks every instruction reachable from offset 0 of the program,
+// reporting the first problem it finds
+bool verify_program(const uint8_t *memory, uint32_t memSize);
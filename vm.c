@@ -1,26 +1,150 @@
 #include "vm.h"
+#include "bytecode.h"
 #include "display.h"
+#include "jit.h"
+#include "verifier.h"
+#include "guard.h"
+#include "snapshot.h"
+#include "vector.h"
+#include "profile.h"
+#include "sampler.h"
 
-#ifdef DEBUG_INSTRUCTIONS
 #include "debug.h"
-#endif
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Maximum number of bytes a decoded record can span, i.e.
+// two instructions of the longest kind when they are fused
+#define MAX_RECORD_LENGTH 18
+
+// Number of calls the interpreter keeps the return records of
+#define RETURN_DEPTH 64
+
+// A record which a call returns to, along with the index of
+// the long it pushed, see CASE(ret)
+typedef struct{
+    uint32_t sp;
+    Instruction *ip;
+} Return;
+
+// Tail calls only become jumps in an optimized build, unless the
+// compiler can be told to make them so
+#ifdef REAL_TAIL_CALLS
+#undef REAL_COMPUTED_GOTO
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+#ifndef MUSTTAIL
+#ifndef __OPTIMIZE__
+#error "REAL_TAIL_CALLS needs the musttail attribute, or an optimized build"
+#endif
+#define MUSTTAIL
+#endif
+#endif
+
+typedef enum{
+    H_decode,
+    #define OPCODE(name, a, b) H_##name,
+    #define SUPERINSTRUCTION(first, second) H_##first##_##second,
+    #include "opcodes.h"
+    #undef SUPERINSTRUCTION
+    #undef OPCODE
+    H_native,
+    H_backedge,
+    H_fault,
+    // Counting variants of the opcodes, for profiled machines
+    #define OPCODE(name, a, b) H_profile_##name,
+    #include "opcodes.h"
+    #undef OPCODE
+    // and the ones which store the PC, for sampled machines
+    #define OPCODE(name, a, b) H_sample_##name,
+    #include "opcodes.h"
+    #undef OPCODE
+} Handler;
+
+enum{
+    #define OPCODE(name, length, b) LENGTH_##name = length,
+    #include "opcodes.h"
+    #undef OPCODE
+};
+
+static const char* opStrings [] = {
+    #define OPCODE(name, a, b) #name,
+    #include "opcodes.h"
+    #undef OPCODE
+};
+
+static const struct{
+    Code first, second;
+    Handler handler;
+} superinstructions[] = {
+    #define OPCODE(name, a, b)
+    #define SUPERINSTRUCTION(first, second) {OP_##first, OP_##second, H_##first##_##second},
+    #include "opcodes.h"
+    #undef SUPERINSTRUCTION
+    #undef OPCODE
+};
 
 VirtualMachine* rm_new(){
     VirtualMachine *machine = (VirtualMachine *)malloc(sizeof(VirtualMachine));
     machine->memory = NULL;
+    machine->mapping = NULL;
+#ifdef GUARD_MEMORY
+    machine->guarded = false;
+#endif
+    machine->snapshot = NULL;
+    machine->dirty = NULL;
+    machine->dirtyChunks = NULL;
+    machine->dirtyCount = 0;
+    machine->code = NULL;
+    machine->codeMap = NULL;
+    machine->stack = NULL;
+    machine->stackSize = machine->SP = 0;
+    machine->jit = NULL;
+    machine->profile = NULL;
+    machine->sampler = NULL;
+    machine->variant = RM_UNCHECKED;
+#ifdef SANITIZE_ACCESS
+    machine->variant |= RM_CHECKED;
+#endif
+#ifdef DEBUG_INSTRUCTIONS
+    machine->variant |= RM_TRACED;
+#endif
+    output_init_fd(&machine->output, STDOUT_FILENO);
+    machine->retired = 0;
+    machine->limit = UINT64_MAX;
     machine->PC = machine->SR = 0;
+    machine->flagOp = FLAGS_SETTLED;
     for(uint8_t i = 0;i < 8;i++)
         machine->registers[i] = 0;
+    for(uint8_t i = 0;i < SI_count;i++)
+        machine->fusedSites[i] = 0;
     return machine;
 }
 
 void rm_free(VirtualMachine *machine){
-    free(machine->memory);
+    output_flush(&machine->output);
+    output_free(&machine->output);
+    jit_free(machine);
+    profile_free(machine->profile);
+    sampler_free(machine->sampler);
+    if(machine->mapping != NULL)
+        munmap(machine->mapping, machine->mappingSize);
+    else
+        free(machine->memory);
+    free(machine->dirty);
+    free(machine->dirtyChunks);
+    free(machine->code);
+    free(machine->codeMap);
+    free(machine->stack);
     free(machine);
 }
 
@@ -38,204 +162,461 @@ bool rm_init(VirtualMachine *machine, uint32_t mem){
     return true;
 }
 
-void rm_run(VirtualMachine *machine, uint32_t offset){
-    if(offset > machine->memSize)
+void rm_print_superinstructions(VirtualMachine *machine){
+    pblue(ANSI_FONT_BOLD "\nSuperinstruction\t");
+    pgrn(ANSI_FONT_BOLD "Sites\n");
+    for(uint8_t i = 0;i < SI_count;i++){
+        pblue("%6s + %-6s\t", opStrings[superinstructions[i].first], opStrings[superinstructions[i].second]);
+        pgrn("%5" PRIu32 "\n", machine->fusedSites[i]);
+    }
+}
+
+bool rm_stack(VirtualMachine *machine, uint32_t size){
+    if(machine->code != NULL || size == 0 || size > UINT32_MAX / sizeof(uint32_t))
+        return false;
+    uint32_t *stack = (uint32_t *)realloc(machine->stack, sizeof(uint32_t) * size);
+    if(stack == NULL)
+        return false;
+    machine->stack = stack;
+    machine->stackSize = machine->SP = size;
+    return true;
+}
+
+bool rm_profile(VirtualMachine *machine){
+    if(machine->code != NULL || machine->sampler != NULL)
+        return false;
+    if(machine->profile == NULL)
+        machine->profile = profile_new(machine->memSize);
+    return machine->profile != NULL;
+}
+
+bool rm_variant(VirtualMachine *machine, uint8_t variant){
+    if(machine->code != NULL || variant > (RM_CHECKED | RM_TRACED))
+        return false;
+    machine->variant = variant;
+    return true;
+}
+
+bool rm_sample(VirtualMachine *machine, uint32_t interval){
+    if(machine->code != NULL || machine->profile != NULL || interval == 0)
+        return false;
+    if(machine->sampler == NULL)
+        machine->sampler = sampler_new(machine->memSize, interval);
+    return machine->sampler != NULL;
+}
+
+/* Instruction cache
+ * =================
+ *
+ * Instructions are decoded lazily, the first time the
+ * dispatcher reaches them. The record at memSize is a
+ * sentinel, which decodes to an error, so that falling
+ * through the end of the memory, or jumping past it, is
+ * caught by the decoder instead of at each dispatch.
+ */
+
+static bool rm_prepare(VirtualMachine *machine){
+    if(machine->code != NULL)
+        return true;
+    if(machine->stack == NULL && !rm_stack(machine, RM_STACK_SIZE))
+        return false;
+    machine->code = (Instruction *)calloc(machine->memSize + 1, sizeof(Instruction));
+    // Padded so that a long can be looked up at any offset
+    machine->codeMap = (uint8_t *)calloc(machine->memSize + 4, sizeof(uint8_t));
+#ifdef GUARD_MEMORY
+    // Without the guard, the decoder checks the operands instead
+    if(!guard_memory(machine))
+        warn("Unable to map the guard pages, checking each instruction instead!");
+#endif
+    return machine->code != NULL && machine->codeMap != NULL;
+}
+
+static void decode(VirtualMachine *machine, uint32_t offset, const int32_t *handlers){
+    Instruction *ins = &machine->code[offset];
+    Operation op;
+
+    if(!bc_decode_op(machine->memory, offset, machine->memSize, &op)){
+        ins->handler = handlers[H_nex];
+        ins->length = 1;
         return;
-    machine->PC = offset;
+    }
 
-    static uint8_t instruction = 0;
-
-    #ifdef SANITIZE_ACCESS
-    #define CHECK_BOUNDS(x) \
-            if((uint32_t)(x) >= machine->memSize || machine->SR == 215) {\
-                uint32_t y = machine->SR == 215 ? machine->AR : (uint32_t)x; \
-                err("Trying to %s unmapped memory at offset " ANSI_COLOR_RED ANSI_FONT_BOLD \
-                        "%04" PRIu32 ANSI_COLOR_RESET "!\n", \
-                        machine->SR == 215 ? "read from" : "write to", (uint32_t)y); \
-                machine->SR = machine->AR = 0; \
-                return; \
-            } 
-    #define READ_BYTE(x) ((uint32_t)x >= machine->memSize) ? machine->SR = 215, machine->AR = x, 0 : machine->memory[x]
-    #else
-    #define READ_BYTE(x) machine->memory[x]
-    #define CHECK_BOUNDS(x) {}
-    #endif
-
-    #define READ_WORD(x) ((READ_BYTE(x) << 8) | (READ_BYTE(x + 1)))
-    #define READ_LONG(x) ((READ_WORD(x) << 16) | (READ_WORD(x + 2)))
-
-    #define WRITE_BYTE(x, y) {CHECK_BOUNDS(x); machine->memory[x] = y;}
-    #define WRITE_WORD(x, y) {WRITE_BYTE(x, (y & 0xff00) >> 8); WRITE_BYTE(x + 1, (y & 0xff));}
-    #define WRITE_LONG(x, y) {WRITE_WORD(x, (y & 0xffff0000) >> 16); WRITE_WORD(x + 2, (y & 0xffff));}
-
-
-    #ifdef DEBUG_INSTRUCTIONS
-    #define DEBUG_INS() { \
-        uint32_t offs = machine->PC; \
-        debugInstruction(machine->memory, &offs, machine->memSize); \
-        getc(stdin); }
-    #else
-    #define DEBUG_INS() {}
-    #endif
-
-    #ifdef REAL_COMPUTED_GOTO
-
-    static void* dispatchTable[] = {
-        #define OPCODE(name, a, b) &&code_##name,
-        #include "opcodes.h"
-        #undef OPCODE
-    };
-
-    #define CASE(name) code_##name
-    #define DISPATCH() \
-        DEBUG_INS(); \
-        CHECK_BOUNDS(machine->PC); \
-        goto *dispatchTable[instruction = READ_BYTE(machine->PC)];
-
-    #define INTERPRET_LOOP DISPATCH()
-
-    #else
-
-    #define CASE(name) case OP_##name
-    #define DISPATCH() goto loop
-    #define INTERPRET_LOOP \
-        loop: \
-        DEBUG_INS(); \
-        CHECK_BOUNDS(machine->PC); \
-        switch(instruction = READ_BYTE(machine->PC))
-
-    #endif
-
-    #define INCR_PC(x) machine->PC += x
-
-    #define BINARY(x) \
-            regl(READ_BYTE(machine->PC + 2)) = regl(READ_BYTE(machine->PC + 1)) x \
-                                regl(READ_BYTE(machine->PC + 2)); \
-            INCR_PC(3); \
-            DISPATCH()
-
-    #define BICONDITIONAL(x) \
-            if(regl(READ_BYTE(machine->PC + 1)) x regl(READ_BYTE(machine->PC + 2))){ \
-                machine->PC = READ_LONG(machine->PC + 3); \
-                DISPATCH(); \
-            } \
-            INCR_PC(7); \
-            DISPATCH()
-
-    #define STATUS_JUMP(x) \
-            if(machine->SR == x) { \
-                machine->PC = READ_BYTE(machine->PC + 1); \
-                DISPATCH(); \
-            } \
-            INCR_PC(5); \
-            DISPATCH();
-
-    #define SHIFT(x) \
-            regl(READ_BYTE(machine->PC + 1)) = regl(READ_BYTE(machine->PC + 1)) x READ_LONG(machine->PC + 2); \
-            INCR_PC(6); \
-            DISPATCH();
-
-    INTERPRET_LOOP
-    {
-        CASE(add):
-            BINARY(+);
-        CASE(sub):
-            BINARY(-);
-        CASE(mul):
-            BINARY(*);
-        CASE(div):
-            BINARY(/);
-        CASE(and):
-            BINARY(&);
-        CASE(or):
-            BINARY(|);
-        CASE(not):
-            regl(READ_BYTE(machine->PC + 1)) = ~regl(READ_BYTE(machine->PC + 1));
-            INCR_PC(2);
-            DISPATCH();
-        CASE(lshift):
-            SHIFT(<<);
-        CASE(rshift):
-            SHIFT(>>);
-        CASE(load):
-            regl(READ_BYTE(machine->PC + 5)) = READ_LONG(READ_LONG(machine->PC + 1));
-            INCR_PC(6);
-            DISPATCH();
-        CASE(store):
-            WRITE_LONG(READ_LONG(machine->PC + 2), regl(READ_BYTE(machine->PC + 1)));
-            INCR_PC(6);
-            DISPATCH();
-        CASE(mov):
-            regl(READ_BYTE(machine->PC + 5)) = READ_LONG(machine->PC + 1);
-            INCR_PC(6);
-            DISPATCH();
-        CASE(save):
-            WRITE_LONG(READ_LONG(machine->PC + 5), READ_LONG(machine->PC + 1));
-            INCR_PC(9);
-            DISPATCH();
-        CASE(print):
-            printf("%" PRId32, (int32_t)READ_LONG(READ_LONG(machine->PC + 1)));
-            INCR_PC(5);
-            DISPATCH();
-        CASE(printc):
-            printf("%c", READ_BYTE(READ_LONG(machine->PC + 1)));
-            INCR_PC(5);
-            DISPATCH();
-        CASE(jeq):
-            BICONDITIONAL(==);
-        CASE(jne):
-            BICONDITIONAL(!=);
-        CASE(jgt):
-            BICONDITIONAL(>);
-        CASE(jlt):
-            BICONDITIONAL(<);
-        CASE(jov):
-            STATUS_JUMP(1);
-        CASE(jun):
-            STATUS_JUMP(2);
-        CASE(clrpc):
-            machine->PC = 0;
-            DISPATCH();
-        CASE(clrsr):
-            machine->SR = 0;
-            INCR_PC(1);
-            DISPATCH();
-        CASE(halt):
-            return;
-        CASE(const): 
-        CASE(str):
-            // this should never be the case
-            DISPATCH();
-        CASE(nex):
-            err("Trying to execute non-executable code at offset " 
-                    ANSI_FONT_BOLD ANSI_COLOR_RED "%04" PRIu32 ANSI_COLOR_RESET "!\n", machine->PC);
+    // Operands outside the memory fault when the record runs,
+    // with the offset in a, and whether it writes in r1. Guarded
+    // memory faults by itself, unless the accesses are sanitized
+    // before they get there.
+#ifdef GUARD_MEMORY
+    bool guarded = machine->guarded && !(machine->variant & RM_CHECKED);
+#else
+    bool guarded = false;
+#endif
+    uint32_t address;
+    bool write;
+    if(!guarded && !verify_access(&op, machine->memSize, &address, &write)){
+        ins->handler = handlers[H_fault];
+        ins->length = op.length;
+        ins->a = address;
+        ins->r1 = write;
+        for(uint32_t i = 0;i < op.length;i++)
+            machine->codeMap[offset + i] |= 1;
+        return;
+    }
+
+    // H_x follows OP_x by one, to leave zero to the decoder, and
+    // so does H_profile_x after H_fault, followed by H_sample_x
+    uint32_t first = H_decode + 1;
+    if(machine->profile != NULL)
+        first = H_fault + 1;
+    else if(machine->sampler != NULL)
+        first = H_fault + 1 + PROFILE_OPCODES;
+    ins->handler = handlers[first + op.opcode];
+    ins->length = op.length;
+    ins->r1 = op.reg[0];
+    ins->r2 = op.reg[1];
+    ins->r3 = op.reg[2];
+    ins->a = op.val[0];
+    ins->b = op.val[1];
+
+    switch(op.opcode){
+        case OP_jeq:
+        case OP_jne:
+        case OP_jgt:
+        case OP_jlt:
+        case OP_jeqi:
+        case OP_jnei:
+        case OP_jgti:
+        case OP_jlti:
+        case OP_jov:
+        case OP_jun:
+        case OP_jmp:
+        case OP_call:
+        case OP_loop:
+        case OP_djnz:
+            // Jumps past the memory land on the sentinel
+            if(ins->a > machine->memSize)
+                ins->a = machine->memSize;
+            break;
+        default:
+            break;
+    }
+
+    for(uint32_t i = 0;i < op.length;i++)
+        machine->codeMap[offset + i] |= 1;
+
+    // Profiles and samples see each instruction on its own
+    if(machine->profile != NULL || machine->sampler != NULL)
+        return;
+
+    // So do traced machines, which count the trips of their
+    // backward jumps in b, to find the hot loops. djnz keeps its
+    // lane there, and the JIT leaves it to the interpreter anyway.
+    if(jit_tracing(machine)){
+        bool jump = op.opcode == OP_jmp || (bc_is_conditional(op.opcode) && op.opcode != OP_djnz);
+        if(jump && ins->a <= offset){
+            ins->handler = handlers[H_backedge];
+            ins->b = 0;
+        }
+        return;
+    }
+
+    // Fuse with the next instruction if the pair is a known
+    // superinstruction. The fused record spans both, so that
+    // a write to either of them drops it, and a store which
+    // writes to it dispatches to the second on its own.
+    uint32_t next = offset + op.length;
+    Operation nextOp;
+    if(!bc_decode_op(machine->memory, next, machine->memSize, &nextOp)
+            || (!guarded && !verify_access(&nextOp, machine->memSize, &address, &write)))
+        return;
+    for(uint8_t i = 0;i < SI_count;i++){
+        if(superinstructions[i].first == op.opcode && superinstructions[i].second == nextOp.opcode){
+            if(machine->code[next].length == 0)
+                decode(machine, next, handlers);
+            ins->handler = handlers[superinstructions[i].handler];
+            ins->length = op.length + nextOp.length;
+            machine->fusedSites[i]++;
             return;
-        CASE(mcopy):
-            WRITE_LONG(READ_LONG(machine->PC + 5), READ_LONG(READ_LONG(machine->PC + 1)));
-            INCR_PC(9);
-            DISPATCH();
-        CASE(rcopy):
-            regl(READ_BYTE(machine->PC + 2)) = regl(READ_BYTE(machine->PC + 1));
-            INCR_PC(3);
-            DISPATCH();
-        CASE(jmp):
-            machine->PC = READ_LONG(machine->PC + 1);
-            DISPATCH();
-        CASE(incr):
-            regl(READ_BYTE(machine->PC + 1))++;
-            INCR_PC(2);
-            DISPATCH();
-        CASE(decr):
-            regl(READ_BYTE(machine->PC + 1))--;
-            INCR_PC(2);
-            DISPATCH();
-        CASE(prints):{
-            uint32_t offset = READ_LONG(machine->PC + 1);
-            uint32_t i = 0, len = READ_LONG(machine->PC + 5);
-            while(i < len){
-                printf("%c", READ_BYTE(offset + i));
-                i++;
-            }
         }
     }
 }
+
+// Drops the records overlapping a write to the memory, so that
+// the modified code is decoded again when it is reached.
+void rm_invalidate(VirtualMachine *machine, uint32_t offset, uint32_t bytes){
+    uint32_t from = offset < MAX_RECORD_LENGTH ? 0 : offset - MAX_RECORD_LENGTH + 1;
+    for(uint32_t i = from;i < offset + bytes && i < machine->memSize;i++){
+        if(machine->code[i].length && i + machine->code[i].length > offset)
+            memset(&machine->code[i], 0, sizeof(Instruction));
+    }
+    if(machine->jit != NULL)
+        jit_invalidate(machine, offset, bytes);
+}
+
+// Marks a block written by bcopy or bfill, like WRITE_LONG marks
+// a long. Most blocks are data, so the code map is only scanned,
+// and the records are dropped only if it has marks there.
+static void blockWritten(VirtualMachine *machine, uint32_t offset, uint32_t bytes){
+    if(bytes == 0)
+        return;
+    if(machine->dirty != NULL)
+        rm_dirty(machine, offset, bytes);
+    const uint8_t *map = &machine->codeMap[offset];
+    uint8_t marks = 0;
+    for(uint32_t i = 0;i < bytes;i++)
+        marks |= map[i];
+    if(marks)
+        rm_invalidate(machine, offset, bytes);
+}
+
+// SR after the operation op on a and b, or SR as it is if settled
+static uint8_t status(uint8_t op, int32_t a, int32_t b, uint8_t SR){
+    int32_t result;
+    switch(op){
+        case FLAGS_ADD:
+            return __builtin_add_overflow(a, b, &result) ? (b > 0 ? 1 : 2) : 0;
+        case FLAGS_SUB:
+            return __builtin_sub_overflow(a, b, &result) ? (b < 0 ? 1 : 2) : 0;
+        case FLAGS_MUL:
+            return __builtin_mul_overflow(a, b, &result) ? ((a < 0) == (b < 0) ? 1 : 2) : 0;
+        case FLAGS_INCR:
+            return a == INT32_MAX ? 1 : 0;
+        case FLAGS_DECR:
+            return a == INT32_MIN ? 2 : 0;
+        default:
+            return SR;
+    }
+}
+
+uint8_t rm_status(VirtualMachine *machine){
+    machine->SR = status(machine->flagOp, machine->flagA, machine->flagB, machine->SR);
+    machine->flagOp = FLAGS_SETTLED;
+    return machine->SR;
+}
+
+/* Interpreter state
+ * =================
+ *
+ * The hot state of the machine lives in locals while rm_run
+ * executes. The program counter is a pointer to the present
+ * record, the registers are copied into a local array, as are
+ * the pending status flags and the stack pointer, and the
+ * memory and stack bases are cached, so that none of them has
+ * to be reloaded through the machine after each write to the
+ * memory. They are written back to the VirtualMachine when it
+ * halts, at errors, and before anything outside rm_run looks
+ * at them.
+ *
+ * Budgets
+ * =======
+ *
+ * rm_run_for stops the machine once it has dispatched at least
+ * the given number of instructions, and can be called again to
+ * go on from the saved PC. The budget is only checked at taken
+ * jumps, since only a loop can run for long without one, so it
+ * may overshoot by a straight run of instructions. Native blocks
+ * charge their loops at each back edge.
+ */
+
+// Instances of execute, see Variants, indexed by the RunVariant
+// flags of the machine
+static RunStatus execute_unchecked(VirtualMachine *machine, uint64_t budget);
+static RunStatus execute_checked(VirtualMachine *machine, uint64_t budget);
+static RunStatus execute_traced(VirtualMachine *machine, uint64_t budget);
+static RunStatus execute_checked_traced(VirtualMachine *machine, uint64_t budget);
+static RunStatus (*const variants[])(VirtualMachine *, uint64_t) = {
+    execute_unchecked,
+    execute_checked,
+    execute_traced,
+    execute_checked_traced
+};
+
+// Whether a conditional jump jumps, for the profile. Folds away for
+// the other opcodes.
+static inline bool taken(Code op, const int32_t *registers, const Instruction *ins){
+    switch(op){
+        case OP_jeq:
+            return registers[ins->r1] == registers[ins->r2];
+        case OP_jne:
+            return registers[ins->r1] != registers[ins->r2];
+        case OP_jgt:
+            return registers[ins->r1] > registers[ins->r2];
+        case OP_jlt:
+            return registers[ins->r1] < registers[ins->r2];
+        case OP_jeqi:
+            return registers[ins->r1] == (int32_t)ins->b;
+        case OP_jnei:
+            return registers[ins->r1] != (int32_t)ins->b;
+        case OP_jgti:
+            return registers[ins->r1] > (int32_t)ins->b;
+        case OP_jlti:
+            return registers[ins->r1] < (int32_t)ins->b;
+        // Before they count down
+        case OP_loop:
+            return registers[ins->r1] != 1;
+        case OP_djnz:
+            return (((uint32_t)registers[ins->r1] >> (ins->b * 8)) & 0xff) != 1;
+        default:
+            return false;
+    }
+}
+
+RunStatus rm_run(VirtualMachine *machine, uint32_t offset){
+    machine->PC = offset;
+    return rm_run_for(machine, UINT64_MAX);
+}
+
+static RunStatus run(VirtualMachine *machine, uint64_t budget);
+
+RunStatus rm_run_for(VirtualMachine *machine, uint64_t budget){
+    if(machine->PC > machine->memSize)
+        return RM_FAULT;
+    if(!rm_prepare(machine)){
+        err("Unable to allocate the instruction cache!\n");
+        return RM_FAULT;
+    }
+    if(machine->sampler == NULL)
+        return run(machine, budget);
+
+    // The timer only ticks while the machine runs
+    bool ticking = sampler_start(machine);
+    if(!ticking)
+        warn("Unable to start the sampling timer, running without it!");
+    RunStatus status = run(machine, budget);
+    if(ticking)
+        sampler_stop();
+    return status;
+}
+
+static RunStatus run(VirtualMachine *machine, uint64_t budget){
+#ifdef GUARD_MEMORY
+    // An access which hits the guard pages lands here. The PC and
+    // the registers are left as they were last written back.
+    Guard *guard = guard_enter(machine);
+    if(sigsetjmp(guard->env, 0)){
+        output_flush(&machine->output);
+        err("Trying to %s unmapped memory at offset " ANSI_COLOR_RED ANSI_FONT_BOLD
+                "%04" PRIu32 ANSI_COLOR_RESET "!\n", guard->write ? "write to" : "read from", machine->AR);
+        return RM_FAULT;
+    }
+    RunStatus status = variants[machine->variant](machine, budget);
+    guard_leave();
+    return status;
+#else
+    return variants[machine->variant](machine, budget);
+#endif
+}
+
+#ifndef REAL_COMPUTED_GOTO
+// Handlers are their values in Handler, for a switch, or for the
+// table of handler functions
+static const int32_t handlers[] = {
+    H_decode,
+    #define OPCODE(name, a, b) H_##name,
+    #define SUPERINSTRUCTION(first, second) H_##first##_##second,
+    #include "opcodes.h"
+    #undef SUPERINSTRUCTION
+    #undef OPCODE
+    H_native,
+    H_backedge,
+    H_fault,
+    #define OPCODE(name, a, b) H_profile_##name,
+    #include "opcodes.h"
+    #undef OPCODE
+    #define OPCODE(name, a, b) H_sample_##name,
+    #include "opcodes.h"
+    #undef OPCODE
+};
+#endif
+
+#ifdef REAL_TAIL_CALLS
+/* Dispatch by tail calls
+ * ======================
+ *
+ * Each handler is a function of its own, which ends by calling
+ * the next one with the same arguments, so that the call is a
+ * jump. The hot state travels in the argument registers, the
+ * rest stays in the interpreter, which lives as long as execute.
+ */
+typedef struct{
+    VirtualMachine *machine;
+    Instruction *code;
+    RmOutput *output;
+    uint8_t *dirty;
+    Profile *profile;
+    uint32_t *stack;
+    uint64_t limit;
+    uint8_t flagOp;
+    int32_t flagA, flagB;
+    uint32_t sp;
+    Return returns[RETURN_DEPTH];
+    uint32_t returnTop, returnCount;
+} Interpreter;
+
+#define TAIL_PARAMS Interpreter *in, Instruction *ip, int32_t *registers, uint8_t *memory, uint64_t retired
+typedef RunStatus (*TailHandler)(TAIL_PARAMS);
+
+#endif
+
+/* Variants
+ * ========
+ *
+ * execute is compiled once for each combination of RunVariant
+ * flags, from the same handlers, and rm_run picks the one the
+ * machine asks for.
+ */
+
+// name_variant, for the functions of each variant
+#define VARIANT_NAME(name) VARIANT_PASTE(name, VARIANT)
+#define VARIANT_PASTE(name, variant) VARIANT_PASTE_(name, variant)
+#define VARIANT_PASTE_(name, variant) name##_##variant
+
+// A read of a checked variant, which leaves 215 in SR, and the
+// address in AR, if it is outside the memory
+static inline uint8_t readChecked(VirtualMachine *machine, const uint8_t *memory, uint32_t x){
+    if(x >= machine->memSize){
+        machine->SR = 215;
+        machine->AR = x;
+        return 0;
+    }
+    return memory[x];
+}
+
+// Traced machines wait for a key after each instruction when
+// they are stepped through
+#ifdef DEBUG_INSTRUCTIONS
+#define STEP() getc(stdin)
+#else
+#define STEP() {}
+#endif
+
+#define VARIANT unchecked
+#define CHECKED 0
+#define TRACED 0
+#include "execute.h"
+#undef TRACED
+#undef CHECKED
+#undef VARIANT
+
+#define VARIANT checked
+#define CHECKED 1
+#define TRACED 0
+#include "execute.h"
+#undef TRACED
+#undef CHECKED
+#undef VARIANT
+
+#define VARIANT traced
+#define CHECKED 0
+#define TRACED 1
+#include "execute.h"
+#undef TRACED
+#undef CHECKED
+#undef VARIANT
+
+#define VARIANT checked_traced
+#define CHECKED 1
+#define TRACED 1
+#include "execute.h"
+#undef TRACED
+#undef CHECKED
+#undef VARIANT
@@ -2,6 +2,7 @@
 #include "rm_common.h"
 #include <stdint.h>
 #include <stdbool.h>
+#include "output.h"
 
 typedef union{
     uint8_t byte[4];
@@ -15,20 +16,122 @@ typedef enum{
     #undef OPCODE
 } Code;
 
+typedef enum{
+    #define OPCODE(name, a, b)
+    #define SUPERINSTRUCTION(first, second) SI_##first##_##second,
+    #include "opcodes.h"
+    #undef SUPERINSTRUCTION
+    #undef OPCODE
+    SI_count
+} Superinstruction;
+
+/* A pre-decoded instruction. The VM keeps one record per
+ * memory offset, so the index of a record is the offset it
+ * was decoded from, and jump targets are record indices as
+ * they are. An all zero record is not decoded yet, and
+ * dispatches to the decoder.
+ */
+typedef struct{
+    int32_t handler; // dispatch target
+    uint8_t length; // bytes the record was decoded from
+    uint8_t r1, r2, r3; // register operands
+    uint32_t a, b; // long operands
+} Instruction;
+
+/* Status flags
+ * ============
+ *
+ * add, sub, mul, incr and decr leave SR at 1 if their result
+ * overflowed, at 2 if it underflowed, and at 0 otherwise. They
+ * only record what they did though, and SR is worked out from
+ * that by rm_status when something reads it.
+ */
+typedef enum{
+    FLAGS_SETTLED, // SR is up to date
+    FLAGS_ADD,
+    FLAGS_SUB,
+    FLAGS_MUL,
+    FLAGS_INCR,
+    FLAGS_DECR
+} FlagOp;
+
 typedef struct{
     uint8_t SR;
+    uint8_t flagOp; // last arithmetic operation, if SR is not settled
+    int32_t flagA, flagB; // and its operands
     uint32_t memSize;
     int32_t registers[8];
-#ifdef SANITIZE_ACCESS
     uint32_t AR; // Access register, to store the address of fault access
-#endif
     uint64_t PC;
+    uint32_t *stack; // longs pushed by call and push, outside the memory
+    uint32_t stackSize; // number of longs the stack holds
+    uint32_t SP; // index of the last long pushed, stackSize if none
     uint8_t *memory;
+    uint8_t *mapping; // pages holding the memory, if it is mapped
+    size_t mappingSize;
+#ifdef GUARD_MEMORY
+    bool guarded; // the mapping ends with guard pages
+#endif
+    Instruction *code; // decoded records, one per offset
+    uint8_t *codeMap; // marks the bytes covered by decoded records
+    struct Jit *jit; // native code, if the JIT is enabled
+    struct Profile *profile; // execution counts, if the machine is profiled
+    struct Sampler *sampler; // PC samples, if the machine is sampled
+    uint8_t variant; // RunVariant flags of the interpreter it runs on
+    RmOutput output; // where print, printc and prints write
+    uint64_t retired; // instructions dispatched, a native block counts as one
+    uint64_t limit; // value of retired at which rm_run_for stops
+    struct Snapshot *snapshot; // spawned from, if any
+    uint8_t *dirty; // whether each chunk was written since the last reset
+    uint32_t *dirtyChunks; // chunks which are not clean, in any order
+    uint32_t dirtyCount;
+    uint32_t fusedSites[SI_count]; // superinstructions formed by the decoder
 } VirtualMachine;
 
+// Number of longs the stack holds, unless rm_stack is called
+#define RM_STACK_SIZE 1024
+
+/* Interpreter variants
+ * ====================
+ *
+ * The interpreter is compiled in each combination of these, and
+ * a machine runs on the one it asks for with rm_variant. Neither
+ * of the checked and the traced ones runs native code.
+ */
+typedef enum{
+    RM_UNCHECKED = 0, // trusts the verifier, and the decoder
+    RM_CHECKED = 1, // checks each access, and each dispatch
+    RM_TRACED = 2 // prints each instruction before it runs
+} RunVariant;
+
+// Why rm_run or rm_run_for returned
+typedef enum{
+    RM_HALTED, // the machine executed halt
+    RM_BUDGET, // the instruction budget ran out
+    RM_FAULT // an error stopped the machine
+} RunStatus;
+
 VirtualMachine* rm_new();
 bool rm_init(VirtualMachine *machine, uint32_t memSize);
-void rm_run(VirtualMachine *machine, uint32_t offset);
+RunStatus rm_run(VirtualMachine *machine, uint32_t offset);
+RunStatus rm_run_for(VirtualMachine *machine, uint64_t budget);
 void rm_free(VirtualMachine *machine);
+void rm_invalidate(VirtualMachine *machine, uint32_t offset, uint32_t bytes);
+// Settles SR, and returns it
+uint8_t rm_status(VirtualMachine *machine);
+void rm_print_superinstructions(VirtualMachine *machine);
+// Gives the machine an empty stack of size longs. Only possible
+// before it first runs.
+bool rm_stack(VirtualMachine *machine, uint32_t size);
+// Runs the machine on the interpreter of the given RunVariant
+// flags. Only possible before it first runs.
+bool rm_variant(VirtualMachine *machine, uint8_t variant);
+// Counts the instructions the machine executes from now on, in
+// machine->profile. Only possible before it first runs.
+bool rm_profile(VirtualMachine *machine);
+// Samples the PC of the machine every interval microseconds of CPU
+// time while it runs, in machine->sampler. Only possible before it
+// first runs, and if it is not profiled.
+bool rm_sample(VirtualMachine *machine, uint32_t interval);
 
 #define regl(index) machine->registers[index]